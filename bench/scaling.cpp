@@ -0,0 +1,256 @@
+/*
+ * Sweeps the inputs that stress one code path each, fits how the time
+ * grows with them and flags anything growing faster than linearly.
+ *
+ *     g++ -std=c++11 -O2 -pthread -I.. scaling.cpp $(find .. -maxdepth 1 -name '*.cpp' ! -name preprocessor.cpp)
+ *     ./a.out --out=baseline.json
+ *     ./a.out --baseline=baseline.json
+ *
+ * With --baseline the run fails if a benchmark grows faster than it did
+ * in the baseline, so an accidental quadratic path does not go unnoticed.
+ * A superlinear result fails it too, unless the baseline already records
+ * it as superlinear; such a known cost may only drift by noise.
+ */
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include "preprocessor.h"
+
+namespace {
+    /* exponents above this are reported as superlinear */
+    const double SUPERLINEAR = 1.3;
+    /* how much worse than its baseline an exponent may get */
+    const double TOLERANCE = 0.25;
+    /* how much worse a baseline that is superlinear already may get */
+    const double SUPERLINEAR_TOLERANCE = 0.1;
+
+    class Input {
+    public:
+        std::string source;
+        std::function<void(cpp::Options &)> configure;
+    };
+
+    class Benchmark {
+    public:
+        std::string name;
+        std::vector<unsigned long> sizes;
+        std::function<Input(unsigned long)> generate;
+    };
+
+    class Result {
+    public:
+        std::string name;
+        std::vector<unsigned long> sizes;
+        std::vector<double> seconds;
+        double exponent;
+    };
+
+    std::string benchDir() {
+        static std::string dir;
+        if (dir.empty()) {
+            char name[] = "/tmp/cpp-bench-XXXXXX";
+            dir = mkdtemp(name);
+        }
+        return dir;
+    }
+
+    Input macroNesting(unsigned long n) {
+        std::string s("#define M0 x\n");
+        for (unsigned long i = 1; i<=n; i++)
+            s += "#define M" + std::to_string(i) + " M" + std::to_string(i - 1) + " + " + std::to_string(i) + "\n";
+        for (int i = 0; i<20; i++)
+            s += "M" + std::to_string(n) + "\n";
+        return {s, [](cpp::Options &options) { options.cacheExpansions = false; }};
+    }
+
+    Input macroArguments(unsigned long n) {
+        std::string params, args;
+        for (unsigned long i = 0; i<n; i++) {
+            params += (i? ", a": "a") + std::to_string(i);
+            args += (i? ", ": "") + std::to_string(i);
+        }
+        std::string s("#define F(" + params + ") " + params + "\n");
+        for (int i = 0; i<20; i++)
+            s += "F(" + args + ")\n";
+        return {s, [](cpp::Options &options) { options.cacheExpansions = false; }};
+    }
+
+    Input includeDepth(unsigned long n) {
+        auto dir = benchDir();
+        for (unsigned long i = 0; i<n; i++) {
+            std::ofstream out(dir + "/depth" + std::to_string(i) + ".h");
+            for (int j = 0; j<50; j++)
+                out << "int v" << i << "_" << j << " = " << j << ";\n";
+            if (i + 1 < n)
+                out << "#include \"depth" << i + 1 << ".h\"\n";
+        }
+        // deep enough for every file, or the larger sizes would stop at the limit
+        return {"#include \"" + dir + "/depth0.h\"\n", [n](cpp::Options &options) { options.maxIncludeDepth = (int) n + 1; }};
+    }
+
+    Input ifNesting(unsigned long n) {
+        std::string s;
+        for (unsigned long i = 0; i<n; i++)
+            s += "#if " + std::to_string(i) + " < " + std::to_string(n) + "\nx" + std::to_string(i) + "\n";
+        for (unsigned long i = 0; i<n; i++)
+            s += "#else\ny\n#endif\n";
+        return {s, [](cpp::Options &) {}};
+    }
+
+    Input lineLength(unsigned long n) {
+        std::string line;
+        for (unsigned long i = 0; i<n; i++)
+            line += "a" + std::to_string(i % 10) + " + ";
+        line += "0";
+        return {"#define LONG " + line + "\nLONG\n" + line + "\n", [](cpp::Options &) {}};
+    }
+
+    double timeOnce(const Input &input) {
+        auto options = std::make_shared<cpp::Options>();
+        input.configure(*options);
+        cpp::Preprocessor preprocessor(options);
+        preprocessor.setInput(std::make_shared<std::stringstream>(input.source), benchDir() + "/input.c");
+        cpp::NullSink sink;
+        auto start = std::chrono::steady_clock::now();
+        preprocessor.run(sink);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    /* the best of a few runs, each repeated until it is long enough to measure */
+    double measure(const Input &input) {
+        double best = 1e30;
+        for (int rep = 0; rep<3; rep++) {
+            unsigned long runs = 0;
+            double total = 0;
+            while (total < 0.02) {
+                total += timeOnce(input);
+                runs++;
+            }
+            best = std::min(best, total / runs);
+        }
+        return best;
+    }
+
+    /* least squares slope of log(time) over log(size) */
+    double fitExponent(const std::vector<unsigned long> &sizes, const std::vector<double> &seconds) {
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        auto n = (double) sizes.size();
+        for (unsigned long i = 0; i<sizes.size(); i++) {
+            double x = std::log((double) sizes[i]), y = std::log(seconds[i]);
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    }
+
+    void writeJson(std::ostream &os, const std::vector<Result> &results) {
+        os << "{\n  \"benchmarks\": [\n";
+        for (unsigned long i = 0; i<results.size(); i++) {
+            const auto &r = results[i];
+            os << "    {\"name\": \"" << r.name << "\", \"exponent\": " << r.exponent << ", \"sizes\": [";
+            for (unsigned long j = 0; j<r.sizes.size(); j++)
+                os << (j? ", ": "") << r.sizes[j];
+            os << "], \"seconds\": [";
+            for (unsigned long j = 0; j<r.seconds.size(); j++)
+                os << (j? ", ": "") << r.seconds[j];
+            os << "]}" << (i + 1 < results.size()? ",": "") << "\n";
+        }
+        os << "  ]\n}\n";
+    }
+
+    /* the exponent of every benchmark in a file written by writeJson */
+    std::map<std::string, double> readBaseline(std::istream &is) {
+        std::map<std::string, double> result;
+        std::string line;
+        while (std::getline(is, line)) {
+            auto name = line.find("\"name\": \""), exponent = line.find("\"exponent\": ");
+            if (name == std::string::npos || exponent == std::string::npos)
+                continue;
+            name += 9;
+            result[line.substr(name, line.find('"', name) - name)] = std::stod(line.substr(exponent + 12));
+        }
+        return result;
+    }
+
+    std::vector<unsigned long> doubling(unsigned long from, int steps) {
+        std::vector<unsigned long> sizes;
+        for (int i = 0; i<steps; i++)
+            sizes.push_back(from << i);
+        return sizes;
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string out, baseline;
+    for (int i = 1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, 6, "--out=") == 0)
+            out = arg.substr(6);
+        else if (arg.compare(0, 11, "--baseline=") == 0)
+            baseline = arg.substr(11);
+    }
+
+    std::vector<Benchmark> benchmarks = {
+        {"macro_nesting", doubling(16, 6), macroNesting},
+        {"macro_arguments", doubling(16, 6), macroArguments},
+        {"include_depth", doubling(4, 6), includeDepth},
+        {"if_nesting", doubling(64, 6), ifNesting},
+        {"line_length", doubling(1024, 6), lineLength}
+    };
+
+    std::vector<Result> results;
+    for (const auto &benchmark: benchmarks) {
+        Result result;
+        result.name = benchmark.name;
+        result.sizes = benchmark.sizes;
+        for (auto size: benchmark.sizes)
+            result.seconds.push_back(measure(benchmark.generate(size)));
+        result.exponent = fitExponent(result.sizes, result.seconds);
+        results.push_back(result);
+    }
+
+    int status = 0;
+    std::map<std::string, double> expected;
+    if (!baseline.empty()) {
+        std::ifstream in(baseline);
+        if (!in.is_open()) {
+            std::cerr << "Open file failed: " << baseline << std::endl;
+            return 2;
+        }
+        expected = readBaseline(in);
+    }
+    for (const auto &r: results) {
+        std::printf("%-16s n^%.2f", r.name.c_str(), r.exponent);
+        if (r.exponent > SUPERLINEAR)
+            std::printf("  superlinear");
+        auto it = expected.find(r.name);
+        if (it != expected.end()) {
+            std::printf("  (baseline n^%.2f)", it->second);
+            bool known = it->second > SUPERLINEAR;
+            if (r.exponent > it->second + (known? SUPERLINEAR_TOLERANCE: TOLERANCE) ||
+                (r.exponent > SUPERLINEAR && !known)) {
+                std::printf("  REGRESSED");
+                status = 1;
+            } else if (known) {
+                std::printf("  accepted");
+            }
+        } else if (!baseline.empty() && r.exponent > SUPERLINEAR) {
+            std::printf("  REGRESSED");
+            status = 1;
+        }
+        std::printf("\n");
+    }
+    if (!out.empty()) {
+        std::ofstream os(out);
+        writeJson(os, results);
+    }
+    return status;
+}
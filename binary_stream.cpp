@@ -0,0 +1,207 @@
+#include "preprocessor.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cpp {
+    namespace {
+        inline void putVarint(std::string &out, unsigned long v) {
+            while (v >= 0x80) {
+                out.push_back((char) ((v & 0x7f) | 0x80));
+                v >>= 7;
+            }
+            out.push_back((char) v);
+        }
+
+        inline void putFixed(std::string &out, unsigned long v, int bytes) {
+            for (int i = 0; i<bytes; i++)
+                out.push_back((char) (v >> (8 * i) & 0xff));
+        }
+
+        inline unsigned long getFixed(const char *p, int bytes) {
+            unsigned long v = 0;
+            for (int i = 0; i<bytes; i++)
+                v |= (unsigned long) (unsigned char) p[i] << (8 * i);
+            return v;
+        }
+
+        inline unsigned long zigzag(long v) {
+            return ((unsigned long) v << 1) ^ (unsigned long) (v >> (sizeof(long) * 8 - 1));
+        }
+
+        inline long unzigzag(unsigned long v) {
+            return (long) (v >> 1) ^ -(long) (v & 1);
+        }
+
+        inline void corrupt() {
+            throw ParsingException("Corrupt binary token stream", posStart);
+        }
+    }
+
+    BinaryTokenWriter::BinaryTokenWriter(std::ostream &o, bool l):
+            os(o), locations(l), newLine(false), leadingSpace(false), file((unsigned long) -1), line(0),
+            recordCount(0), ids(), offsets(1, 0), strings(), records() {}
+
+    unsigned long BinaryTokenWriter::intern(const char *s, unsigned long n) {
+        auto result = ids.insert(std::make_pair(std::string(s, n), ids.size()));
+        if (result.second) {
+            strings.append(s, n);
+            offsets.push_back(strings.size());
+        }
+        return result.first->second;
+    }
+
+    void BinaryTokenWriter::tokens(const TokenRecord *batch, unsigned long count) {
+        for (unsigned long i = 0; i<count; i++) {
+            const auto &record = batch[i];
+            if (record.kind == Token::WHITESPACE) {
+                leadingSpace = true;
+                if (memchr(record.spelling, '\n', record.size) || memchr(record.spelling, '\r', record.size))
+                    newLine = true;
+                continue;
+            }
+            if (record.leadingSpace)
+                leadingSpace = true;
+            unsigned long fileId = 0;
+            bool fileChanged = false;
+            if (locations) {
+                fileId = intern(record.pos->file.data(), record.pos->file.size());
+                fileChanged = fileId != file;
+            }
+            putVarint(records, (unsigned long) record.kind | (unsigned long) newLine << 3 |
+                               (unsigned long) leadingSpace << 4 | (unsigned long) fileChanged << 5);
+            putVarint(records, intern(record.spelling, record.size));
+            if (locations) {
+                if (fileChanged) {
+                    putVarint(records, fileId);
+                    file = fileId;
+                }
+                putVarint(records, zigzag((long) record.pos->line - line));
+                putVarint(records, (unsigned long) record.pos->col);
+                line = record.pos->line;
+            }
+            newLine = leadingSpace = false;
+            recordCount++;
+        }
+    }
+
+    void BinaryTokenWriter::finish() {
+        std::string header(BINARY_MAGIC, 8);
+        putFixed(header, locations? BINARY_LOCATIONS: 0, 4);
+        putFixed(header, ids.size(), 4);
+        putFixed(header, recordCount, 8);
+        putFixed(header, strings.size(), 8);
+        for (auto offset: offsets)
+            putFixed(header, offset, 4);
+        os.write(header.data(), header.size());
+        os.write(strings.data(), strings.size());
+        os.write(records.data(), records.size());
+        os.flush();
+    }
+
+    BinaryTokenReader::BinaryTokenReader(const char *d, unsigned long size):
+            data(d), end(d + size), strings(), records(), cur(), flags(0),
+            _stringCount(0), _recordCount(0), read(0), file(0), line(0) {
+        if (size < BINARY_HEADER_SIZE || memcmp(data, BINARY_MAGIC, 8) != 0)
+            corrupt();
+        flags = getFixed(data + 8, 4);
+        _stringCount = getFixed(data + 12, 4);
+        _recordCount = getFixed(data + 16, 8);
+        auto stringBytes = getFixed(data + 24, 8);
+        auto tableSize = (_stringCount + 1) * 4;
+        if (size - BINARY_HEADER_SIZE < tableSize || size - BINARY_HEADER_SIZE - tableSize < stringBytes)
+            corrupt();
+        strings = data + BINARY_HEADER_SIZE + tableSize;
+        records = strings + stringBytes;
+        // every string must lie within the string data
+        unsigned long last = 0;
+        for (unsigned long i = 0; i<=_stringCount; i++) {
+            auto o = offset(i);
+            if (o < last || o > stringBytes)
+                corrupt();
+            last = o;
+        }
+        if (last != stringBytes)
+            corrupt();
+        rewind();
+    }
+
+    unsigned long BinaryTokenReader::offset(unsigned long id) const {
+        return getFixed(data + BINARY_HEADER_SIZE + id * 4, 4);
+    }
+
+    unsigned long BinaryTokenReader::varint() {
+        unsigned long v = 0;
+        for (int shift = 0; cur < end && shift < 64; shift += 7) {
+            auto c = (unsigned char) *cur++;
+            v |= (unsigned long) (c & 0x7f) << shift;
+            if (!(c & 0x80))
+                return v;
+        }
+        corrupt();
+        return 0;
+    }
+
+    void BinaryTokenReader::rewind() {
+        cur = records;
+        read = 0;
+        file = 0;
+        line = 0;
+    }
+
+    bool BinaryTokenReader::next(BinaryToken &token) {
+        if (read == _recordCount)
+            return false;
+        auto tag = varint();
+        auto id = varint();
+        if ((tag & 7) > Token::OTHER || id >= _stringCount)
+            corrupt();
+        token.kind = (Token::token_type) (tag & 7);
+        token.newLine = tag >> 3 & 1;
+        token.leadingSpace = tag >> 4 & 1;
+        spelling(id, token.spelling, token.size);
+        if (hasLocations()) {
+            if (tag >> 5 & 1) {
+                file = varint();
+                if (file >= _stringCount)
+                    corrupt();
+            }
+            line += (int) unzigzag(varint());
+            token.line = line;
+            token.col = (int) varint();
+            spelling(file, token.file, token.fileSize);
+        } else {
+            token.file = nullptr;
+            token.fileSize = 0;
+            token.line = token.col = 0;
+        }
+        read++;
+        return true;
+    }
+
+    MappedFile::MappedFile(const std::string &path):
+            _data(nullptr), _size(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            if (st.st_size == 0) {
+                _data = "";
+            } else {
+                void *p = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    _data = static_cast<const char*>(p);
+                    _size = (unsigned long) st.st_size;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    MappedFile::~MappedFile() {
+        if (_size > 0)
+            munmap(const_cast<char*>(_data), _size);
+    }
+}
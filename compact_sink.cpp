@@ -0,0 +1,98 @@
+#include "preprocessor.h"
+
+namespace cpp {
+    namespace {
+        /* counts line breaks the way Tokenizer::advanceRaw does */
+        int countLines(const char *p, unsigned long n) {
+            int lines = 0;
+            for (unsigned long i = 0; i<n; i++) {
+                if (p[i] == '\r' || (p[i] == '\n' && (i == 0 || p[i - 1] != '\r')))
+                    lines++;
+            }
+            return lines;
+        }
+    }
+
+    CompactSink::CompactSink(std::ostream &o, bool m):
+            os(o), markers(m), prev(nullptr), prevSize(0), prevKind(Token::WHITESPACE), prevCopy(),
+            lineBreak(false), file(), lastFile(), line(0), lastLine(0) {}
+
+    void CompactSink::startLine(const TokenRecord &record) {
+        // Whitespace always comes from a file, but expanded tokens carry
+        // the position of their #define. A token in column 0 from another
+        // file is taken to be the start of an included file.
+        if (file.empty() || (record.pos->col == 0 && record.pos->file != file)) {
+            file = record.pos->file;
+            line = record.pos->line;
+        }
+        if (markers && (file != lastFile || line != lastLine + 1)) {
+            os << "# " << line << " \"";
+            for (auto c: file) {
+                if (c == '"' || c == '\\')
+                    os.put('\\');
+                os.put(c);
+            }
+            os << "\"\n";
+        }
+        lastFile = file;
+        lastLine = line;
+    }
+
+    void CompactSink::tokens(const TokenRecord *records, unsigned long count) {
+        for (unsigned long i = 0; i<count; i++) {
+            const auto &record = records[i];
+            if (record.kind == Token::WHITESPACE) {
+                auto lines = countLines(record.spelling, record.size);
+                if (lines > 0) {
+                    lineBreak = true;
+                    file = record.pos->file;
+                    line = record.pos->line + lines;
+                } else if (!prev) {
+                    file = record.pos->file;
+                    line = record.pos->line;
+                }
+                continue;
+            }
+            if (prev && lineBreak) {
+                os.put('\n');
+                prev = nullptr;
+            }
+            if (!prev)
+                startLine(record);
+            else if (wouldPaste(prev, prevSize, prevKind, record.spelling, record.size))
+                os.put(' ');
+            os.write(record.spelling, record.size);
+            // a raw string can span lines
+            auto lines = countLines(record.spelling, record.size);
+            auto last = record.size? record.spelling[record.size - 1]: ' ';
+            if (last == '\n' || last == '\r') {
+                // a directive passed through ends its line itself
+                lastLine += lines - 1;
+                file = record.pos->file;
+                line = record.pos->line + lines;
+                prev = nullptr;
+                lineBreak = false;
+                continue;
+            }
+            lastLine += lines;
+            prev = record.spelling;
+            prevSize = record.size;
+            prevKind = record.kind;
+            lineBreak = false;
+        }
+        if (prev) {
+            prevCopy.assign(prev, prevSize);
+            prev = prevCopy.data();
+        }
+    }
+
+    void CompactSink::finish() {
+        if (prev)
+            os.put('\n');
+        prev = nullptr;
+        lineBreak = false;
+        file.clear();
+        lastFile.clear();
+        line = lastLine = 0;
+    }
+}
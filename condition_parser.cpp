@@ -1,4 +1,5 @@
 #include "preprocessor.h"
+#include <unordered_map>
 
 namespace cpp {
     namespace {
@@ -102,6 +103,7 @@ namespace cpp {
                 } else if (c == '\\') {
                     p++;
                     c = v[p];
+                    auto escape = c;
                     if (c == 'a') {
                         d = '\a';
                     } else if (c == 'b') {
@@ -116,6 +118,8 @@ namespace cpp {
                         d = '\t';
                     } else if (c == 'v') {
                         d = '\v';
+                    } else if (c == '\\' || c == '\'' || c == '"' || c == '?') {
+                        d = c;
                     } else if (c == 'u') {
                         if (bits < 2)
                             throw ParsingException("\\u escape not allowed", pos + p);
@@ -141,13 +145,14 @@ namespace cpp {
                     } else if (c == 'x') {
                         d = 0;
                         int b = 0;
+                        p++;
                         while (p < l) {
                             c = v[p];
                             if (!isHexDigit(c))
                                 break;
                             d = d << 4 | hexDigit(c);
-                            b += 2;
-                            if (b > bits)
+                            // two digits to a byte
+                            if (++b > 2 * bits)
                                 throw ParsingException("Invalid escape", pos + p);
                             p++;
                         }
@@ -171,209 +176,240 @@ namespace cpp {
                     } else {
                         unexpected(c, pos + p);
                     }
+                    // the escapes above that stop short of their end
+                    if (escape != 'x' && escape != 'u' && escape != 'U' && !isOctDigit(escape))
+                        p++;
                 } else {
-                    d = c;
+                    d = (unsigned char) c;
+                    p++;
                 }
-                x = (x << bits) | d;
+                x = (x << (8 * bits)) | d;
             }
             return MacroValue(x);
         }
     }
 
-    MacroValue ConditionParser::parsePrimary() {
-        auto token = next();
-        if (token) {
-            if (token->type() == Token::NUMBER) {
-                return parseInt(token->value(), token->pos());
-            } else if (token->type() == Token::CHARACTER) {
-                return parseCharacter(token->value(), token->pos());
-            } else if (token->type() == Token::IDENTIFIER) {
-                if (token->value() == "true") {
-                    return MacroValue(1UL);
-                } else if (token->value() == "defined") {
-                    token = __next(false);
-                    bool paren = false;
-                    if (token && token->type() == Token::WHITESPACE && !token->hasNewLine()) {
-                        token = __next(false);
-                    }
-                    if (token && token->type() == Token::PUNC &&
-                        token->value() == "(") {
-                        paren = true;
-                        token = __next(false);
-                        if (token->type() == Token::WHITESPACE && !token->hasNewLine()) {
-                            token = __next(false);
-                        }
-                    }
-                    if (!token || token->type() != Token::IDENTIFIER)
-                        throw ParsingException("Expected identifier", token->pos());
-                    long v;
-                    if ((*macroTable())[token->value()])
-                        v = 1;
-                    else
-                        v = 0;
-                    if (paren) {
-                        token = __next(false);
-                        if (token && token->type() == Token::WHITESPACE && !token->hasNewLine()) {
-                            token = __next(false);
-                        }
-                        if (!token || token->type() != Token::PUNC ||
-                            token->value() != ")") {
-                            throw ParsingException("Expected )", token? token->pos() : getPos());
-                        }
-                    }
-                    return MacroValue(v);
-                } else {
-                    return MacroValue(0UL);
-                }
-            }
-        }
-        throw ParsingException(("Unexpected " + token->value()).c_str(), token? token->pos(): getPos());
-    }
+    namespace {
+        enum operator_t {
+            NOT_OPERATOR,
+            MUL, DIV, MOD, ADD, SUB, SHL, SHR, LT, LE, GT, GE, EQ, NE,
+            BITAND, XOR, BITOR, AND, OR,
+            NOT, COMPL, QUESTION, COLON, COMMA, LPAREN, RPAREN
+        };
 
-    MacroValue ConditionParser::parseUnary() {
-        while (matchPunc('+')) {}
-        if (matchPunc('-'))
-            return -parseUnary();
-        else if (matchPunc('~'))
-            return ~parseUnary();
-        else if (matchPunc('!') || matchId("not"))
-            return !parseUnary();
-        else
-            return parsePrimary();
-    }
+        class Operator {
+        public:
+            operator_t op;
+            /* binding power as a binary operator, 0 if it is none */
+            int precedence;
+            bool unary;
+        };
 
-    MacroValue ConditionParser::parseMultiply() {
-        auto v = parseUnary();
-        while (!finished()) {
-            if (matchPunc('*'))
-                v = v * parseUnary();
-            else if (matchPunc('/')) {
-                const auto &p = getPos();
-                auto w = parseUnary();
-                if (w.isUnsigned) {
-                    if (w.v.ul == 0)
-                        throw ParsingException("Divide by zero", p);
-                } else {
-                    if (w.v.l == 0)
-                        throw ParsingException("Divide by zero", p);
-                }
-                v = v / parseUnary();
-            } else if (matchPunc('%'))
-                v = v % parseUnary();
-            else
-                break;
+        const Operator NONE = {NOT_OPERATOR, 0, false};
+
+        /* every token an expression can continue with, spelled out once */
+        const Operator &classify(token_t token) {
+            static const std::unordered_map<std::string, Operator> operators = {
+                {"*", {MUL, 10, false}}, {"/", {DIV, 10, false}}, {"%", {MOD, 10, false}},
+                {"+", {ADD, 9, true}}, {"-", {SUB, 9, true}},
+                {"<<", {SHL, 8, false}}, {">>", {SHR, 8, false}},
+                {"<", {LT, 7, false}}, {"<=", {LE, 7, false}}, {">", {GT, 7, false}}, {">=", {GE, 7, false}},
+                {"==", {EQ, 6, false}}, {"!=", {NE, 6, false}}, {"not_eq", {NE, 6, false}},
+                {"&", {BITAND, 5, false}}, {"bitand", {BITAND, 5, false}},
+                {"^", {XOR, 4, false}}, {"xor", {XOR, 4, false}},
+                {"|", {BITOR, 3, false}}, {"bitor", {BITOR, 3, false}},
+                {"&&", {AND, 2, false}}, {"and", {AND, 2, false}},
+                {"||", {OR, 1, false}}, {"or", {OR, 1, false}},
+                {"!", {NOT, 0, true}}, {"not", {NOT, 0, true}},
+                {"~", {COMPL, 0, true}}, {"compl", {COMPL, 0, true}},
+                {"?", {QUESTION, 0, false}}, {":", {COLON, 0, false}}, {",", {COMMA, 0, false}},
+                {"(", {LPAREN, 0, false}}, {")", {RPAREN, 0, false}}
+            };
+            if (!token || (token->type() != Token::PUNC && token->type() != Token::IDENTIFIER))
+                return NONE;
+            auto it = operators.find(token->value());
+            return it == operators.end()? NONE: it->second;
         }
-        return v;
-    }
 
-    MacroValue ConditionParser::parseAdd() {
-        auto v = parseMultiply();
-        while (!finished()) {
-            if (matchPunc('+'))
-                v = v + parseMultiply();
-            else if (matchPunc('-'))
-                v = v - parseMultiply();
-            else
-                break;
+        inline bool isZero(const MacroValue &v) {
+            return v.isUnsigned? v.v.ul == 0: v.v.l == 0;
         }
-        return v;
-    }
 
-    MacroValue ConditionParser::parseShift() {
-        auto v = parseAdd();
-        while (!finished()) {
-            if (matchPunc("<<"))
-                v = v << parseAdd();
-            else if (matchPunc(">>"))
-                v = v >> parseAdd();
-            else
-                break;
+        [[noreturn]] void unexpectedToken(token_t token, const PosInfo &pos) {
+            if (token)
+                throw ParsingException(("Unexpected " + token->value()).c_str(), token->pos());
+            throw ParsingException("Unexpected end of expression", pos);
         }
-        return v;
     }
 
-    MacroValue ConditionParser::parseRelation() {
-        auto v = parseShift();
-        while (!finished()) {
-            if (matchPunc('<'))
-                v = v < parseShift();
-            else if (matchPunc("<="))
-                v = v <= parseShift();
-            else if (matchPunc('>'))
-                v = v > parseShift();
-            else if (matchPunc(">="))
-                v = v > parseShift();
-            else
-                break;
-        }
-        return v;
+    token_t ConditionParser::peek(bool expand) {
+        if (lookahead)
+            return lookahead;
+        do {
+            lookahead = __next(expand);
+        } while (lookahead && lookahead->type() == Token::WHITESPACE);
+        return lookahead;
     }
 
-    MacroValue ConditionParser::parseEquality() {
-        auto v = parseRelation();
-        while (!finished()) {
-            if (matchPunc("==") || matchId("eq"))
-                v = v == parseRelation();
-            else if (matchPunc("!=") || matchId("not_eq"))
-                v = v != parseRelation();
-            else
-                break;
-        }
-        return v;
+    token_t ConditionParser::fetch(bool expand) {
+        auto token = peek(expand);
+        lookahead.reset();
+        if (token)
+            last = token;
+        return token;
     }
 
-    MacroValue ConditionParser::parseBitwiseAnd() {
-        auto v = parseEquality();
-        while (matchPunc('&') || matchId("bitand"))
-            v = v & parseEquality();
-        return v;
+    PosInfo ConditionParser::errorPos() const {
+        return last? last->pos(): getPos();
     }
 
-    MacroValue ConditionParser::parseXor() {
-        auto v = parseBitwiseAnd();
-        while (matchPunc('^') || matchId("xor"))
-            v = v ^ parseBitwiseAnd();
-        return v;
+    void ConditionParser::skipArguments() {
+        int depth = 0;
+        do {
+            auto token = fetch();
+            if (!token)
+                throw ParsingException("Expected )", errorPos());
+            auto op = classify(token).op;
+            if (op == LPAREN)
+                depth++;
+            else if (op == RPAREN)
+                depth--;
+        } while (depth > 0);
     }
 
-    MacroValue ConditionParser::parseBitwiseOr() {
-        auto v = parseXor();
-        while (matchPunc('|') || matchId("bitor"))
-            v = v | parseXor();
-        return v;
+    MacroValue ConditionParser::parsePrimary(bool eval) {
+        auto token = fetch();
+        if (token) {
+            if (token->type() == Token::NUMBER) {
+                return eval? parseInt(token->value(), token->pos()): MacroValue(0L);
+            } else if (token->type() == Token::CHARACTER) {
+                return eval? parseCharacter(token->value(), token->pos()): MacroValue(0L);
+            } else if (token->type() == Token::IDENTIFIER) {
+                if (token->value() == "defined") {
+                    token = fetch(false);
+                    bool paren = classify(token).op == LPAREN;
+                    if (paren)
+                        token = fetch(false);
+                    if (!token || token->type() != Token::IDENTIFIER)
+                        throw ParsingException("Expected identifier", token? token->pos(): errorPos());
+                    long v = macroTable()->find(token->value())? 1: 0;
+                    if (paren && classify(fetch(false)).op != RPAREN)
+                        throw ParsingException("Expected )", errorPos());
+                    return MacroValue(v);
+                } else if (!eval) {
+                    // possibly an unexpanded function-like macro
+                    if (classify(peek()).op == LPAREN)
+                        skipArguments();
+                    return MacroValue(0L);
+                } else if (token->value() == "true") {
+                    return MacroValue(1UL);
+                } else {
+                    return MacroValue(0UL);
+                }
+            } else if (classify(token).op == LPAREN) {
+                auto v = parseComma(eval);
+                if (classify(fetch()).op != RPAREN)
+                    throw ParsingException("Expected )", errorPos());
+                return v;
+            }
+        }
+        unexpectedToken(token, errorPos());
     }
 
-    MacroValue ConditionParser::parseAnd() {
-        auto v = parseBitwiseOr();
-        while (matchPunc("&&") || matchId("and"))
-            v = v && parseBitwiseOr();
-        return v;
+    MacroValue ConditionParser::parseUnary(bool eval) {
+        const auto &op = classify(peek());
+        if (!op.unary)
+            return parsePrimary(eval);
+        fetch();
+        auto v = parseUnary(eval);
+        switch (op.op) {
+            case SUB:
+                return -v;
+            case COMPL:
+                return ~v;
+            case NOT:
+                return !v;
+            default:
+                return v;
+        }
     }
 
-    MacroValue ConditionParser::parseOr() {
-        auto v = parseAnd();
-        while (matchPunc("||") || matchId("or"))
-            v = v || parseAnd();
+    MacroValue ConditionParser::parseBinary(int precedence, bool eval) {
+        auto v = parseUnary(eval);
+        while (true) {
+            auto token = peek();
+            const auto &op = classify(token);
+            if (op.precedence < precedence || op.precedence == 0)
+                break;
+            fetch();
+            if (op.op == AND) {
+                bool lhs = eval && v;
+                auto w = parseBinary(op.precedence + 1, lhs);
+                v = MacroValue(lhs && (bool) w);
+                continue;
+            } else if (op.op == OR) {
+                bool lhs = eval && v;
+                auto w = parseBinary(op.precedence + 1, eval && !lhs);
+                v = MacroValue(lhs || (eval && (bool) w));
+                continue;
+            }
+            auto w = parseBinary(op.precedence + 1, eval);
+            if (!eval)
+                continue;
+            switch (op.op) {
+                case MUL: v = v * std::move(w); break;
+                case DIV:
+                case MOD:
+                    if (isZero(w))
+                        throw ParsingException("Divide by zero", token->pos());
+                    v = op.op == DIV? v / std::move(w): v % std::move(w);
+                    break;
+                case ADD: v = v + std::move(w); break;
+                case SUB: v = v - std::move(w); break;
+                case SHL: v = v << std::move(w); break;
+                case SHR: v = v >> std::move(w); break;
+                case LT: v = v < std::move(w); break;
+                case LE: v = v <= std::move(w); break;
+                case GT: v = v > std::move(w); break;
+                case GE: v = v >= std::move(w); break;
+                case EQ: v = v == std::move(w); break;
+                case NE: v = v != std::move(w); break;
+                case BITAND: v = v & std::move(w); break;
+                case XOR: v = v ^ std::move(w); break;
+                case BITOR: v = v | std::move(w); break;
+                default: break;
+            }
+        }
         return v;
     }
 
-    MacroValue ConditionParser::parseConditional() {
-        auto cond = parseOr();
-        if (matchPunc('?')) {
-            auto seq = parseConditional();
-            expectPunc(':');
-            auto alt = parseConditional();
-            return cond? seq: alt;
-        } else {
+    MacroValue ConditionParser::parseConditional(bool eval) {
+        auto cond = parseBinary(1, eval);
+        if (classify(peek()).op != QUESTION)
             return cond;
+        fetch();
+        bool taken = eval && cond;
+        auto seq = parseComma(taken);
+        if (classify(fetch()).op != COLON)
+            throw ParsingException("Expected :", errorPos());
+        auto alt = parseConditional(eval && !taken);
+        return taken? seq: alt;
+    }
+
+    MacroValue ConditionParser::parseComma(bool eval) {
+        auto v = parseConditional(eval);
+        while (classify(peek()).op == COMMA) {
+            fetch();
+            v = parseConditional(eval);
         }
+        return v;
     }
 
     MacroValue ConditionParser::parse() {
-        auto v = parseConditional();
-        while (matchPunc(',')) {
-            v = parseConditional();
-        }
+        auto v = parseComma(true);
+        auto token = peek();
+        if (token)
+            unexpectedToken(token, errorPos());
         return v;
     }
 }
@@ -1,5 +1,4 @@
 #include "preprocessor.h"
-#include <fstream>
 #include <iostream>
 
 namespace cpp {
@@ -29,52 +28,137 @@ namespace cpp {
         }
     }
 
+    namespace {
+        enum directive_t {
+            NON_DIRECTIVE,
+            IF, IFDEF, IFNDEF, ELIF, ELSE, ENDIF,
+            DEFINE, UNDEF, INCLUDE, INCLUDE_NEXT,
+            PRAGMA, LINE, ERROR
+        };
+
+        class DirectiveName {
+        public:
+            const char *name;
+            unsigned long size;
+            directive_t directive;
+        };
+
+#define DIRECTIVE_HASH_SIZE 32
+        constexpr unsigned long directiveHash(const char *s, unsigned long n) {
+            return (n + 3 * s[0] + 7 * s[n - 1] + s[1]) % DIRECTIVE_HASH_SIZE;
+        }
+
+        /* directive names, each at its directiveHash */
+        constexpr DirectiveName DIRECTIVES[DIRECTIVE_HASH_SIZE] = {
+            {"", 0, NON_DIRECTIVE}, {"include_next", 12, INCLUDE_NEXT}, {"else", 4, ELSE}, {"", 0, NON_DIRECTIVE},
+            {"error", 5, ERROR}, {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE},
+            {"", 0, NON_DIRECTIVE}, {"elif", 4, ELIF}, {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE},
+            {"endif", 5, ENDIF}, {"if", 2, IF}, {"", 0, NON_DIRECTIVE}, {"pragma", 6, PRAGMA},
+            {"ifdef", 5, IFDEF}, {"ifndef", 6, IFNDEF}, {"", 0, NON_DIRECTIVE}, {"include", 7, INCLUDE},
+            {"line", 4, LINE}, {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE},
+            {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE}, {"define", 6, DEFINE}, {"", 0, NON_DIRECTIVE},
+            {"undef", 5, UNDEF}, {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE}, {"", 0, NON_DIRECTIVE}
+        };
+
+        constexpr bool isPerfect(unsigned long i) {
+            return i == DIRECTIVE_HASH_SIZE ||
+                   ((DIRECTIVES[i].size == 0 || directiveHash(DIRECTIVES[i].name, DIRECTIVES[i].size) == i) &&
+                    isPerfect(i + 1));
+        }
+
+        static_assert(isPerfect(0), "DIRECTIVES is not indexed by directiveHash");
+
+        inline directive_t findDirective(token_t name) {
+            if (!name || name->type() != Token::IDENTIFIER)
+                return NON_DIRECTIVE;
+            const std::string &v = name->value();
+            auto n = v.size();
+            if (n < 2)
+                return NON_DIRECTIVE;
+            const auto &entry = DIRECTIVES[directiveHash(v.data(), n)];
+            if (entry.size == n && memcmp(entry.name, v.data(), n) == 0)
+                return entry.directive;
+            return NON_DIRECTIVE;
+        }
+
+        inline bool isConditional(directive_t directive) {
+            return directive >= IF && directive <= ENDIF;
+        }
+    }
+
     token_t DirectiveParser::_next() {
-        if (included) {
-            auto token = included->next();
-            if (token) {
+        while (true) {
+            auto token = nextInFile();
+            if (token)
+                emitted++;
+            if (token || frames.empty())
                 return token;
-            } else {
-                included.reset();
+            if (options()->callbacks) {
+                options()->callbacks->includeLexed(_file, input()->getPos().pos, emitted);
+                options()->callbacks->includeExit(_file);
             }
+            auto &frame = frames.back();
+            setInput(frame.input);
+            _file = std::move(frame.file);
+            ifStack = std::move(frame.ifStack);
+            lineStart = frame.lineStart;
+            emitted = frame.emitted;
+            pathIndex = frame.pathIndex;
+            frames.pop_back();
         }
+    }
+
+    token_t DirectiveParser::nextInFile() {
         token_t sharp;
         auto pos = getPos();
         if (lineStart && (sharp = input()->matchPunc('#'))) {
             input()->space(false);
-            if (input()->matchId("if")) {
-                return parseIf(false);
-            } else if (input()->matchId("ifdef")) {
-                return parseIf(true, false);
-            } else if (input()->matchId("ifndef")) {
-                return parseIf(true, true);
-            } else if (input()->matchId("elif")) {
-                return parseElif(pos);
-            } else if (input()->matchId("else")) {
-                return parseElse(pos);
-            } else if (input()->matchId("endif")) {
-                return parseEndif(pos);
-            } else {
-                if (shouldIgnore(ifStack))
-                    return skipLine();
-                if (input()->matchId("define")) {
+            auto name = input()->next();
+            auto directive = findDirective(name);
+            if (directive == NON_DIRECTIVE) {
+                if (name)
+                    input()->unget(name);
+                return skipLine();
+            }
+            if (!isConditional(directive) && shouldIgnore(ifStack))
+                return skipLine();
+            switch (directive) {
+                case IF:
+                    return parseIf(false);
+                case IFDEF:
+                    return parseIf(true, false);
+                case IFNDEF:
+                    return parseIf(true, true);
+                case ELIF:
+                    return parseElif(pos);
+                case ELSE:
+                    return parseElse(pos);
+                case ENDIF:
+                    return parseEndif(pos);
+                case DEFINE:
                     input()->space(false);
-                    return parseDefine();
-                } else if (input()->matchId("undef")) {
+                    return parseDefine(sharp->pos());
+                case UNDEF:
                     input()->space(false);
-                    return parseUndef();
-                } else if (input()->matchId("include")) {
+                    return parseUndef(sharp->pos());
+                case INCLUDE:
+                case INCLUDE_NEXT:
                     input()->space(false);
-                    return parseInclude(sharp->pos());
-                } else {
+                    return parseInclude(sharp->pos(), directive == INCLUDE_NEXT);
+                case PRAGMA:
+                    input()->space(false);
+                    return parsePragma(sharp->pos());
+                case ERROR:
+                    input()->space(false);
+                    return parseError(sharp->pos());
+                default:
                     return skipLine();
-                }
             }
         } else {
             lineStart = false;
-            if (shouldIgnore(ifStack))
+            if (shouldIgnore(ifStack) || options()->skipText)
                 return skipLine();
-            auto token = input()->next();
+            auto token = source.next();
             if (token && token->type() == Token::WHITESPACE && token->hasNewLine()) {
                 lineStart = true;
             }
@@ -82,8 +166,36 @@ namespace cpp {
         }
     }
 
+    namespace {
+        std::string spell(const std::deque<token_t> &tokens) {
+            std::string result;
+            for (auto token: tokens)
+                result += token->value();
+            return result;
+        }
+    }
+
+    token_t DirectiveParser::parsePragma(const PosInfo &pos) {
+        std::string v("#pragma");
+        auto line = readLine();
+        if (!line.empty())
+            v += " " + spell(line);
+        auto newLine = truncateLine(input()->expectNewLine());
+        if (newLine)
+            unget(newLine);
+        return std::make_shared<Token>(Token::OTHER, v, pos);
+    }
+
+    token_t DirectiveParser::parseError(const PosInfo &pos) {
+        throw ParsingException(("#error " + spell(readLine())).c_str(), pos);
+    }
+
     token_t DirectiveParser::skipLine() {
-        while (auto token = input()->next()) {
+        while (true) {
+            input()->skipText();
+            auto token = source.next();
+            if (!token)
+                break;
             if (token->type() == Token::WHITESPACE && token->hasNewLine()) {
                 lineStart = true;
                 return truncateLine(token);
@@ -94,6 +206,7 @@ namespace cpp {
 
     std::deque<token_t> DirectiveParser::readLine(bool allowVAARGS) {
         std::deque<token_t> result;
+        BudgetCharge charge(options()->memory);
         lineStart = false;
         while (auto token = input()->next()) {
             if (token->type() == Token::WHITESPACE && token->hasNewLine()) {
@@ -105,6 +218,7 @@ namespace cpp {
                        token->value() == "__VA_ARGS__") {
                 throw ParsingException("Unexpected __VA_ARGS__", token->pos());
             } else {
+                charge.charge(*token);
                 result.push_back(token);
             }
         }
@@ -115,8 +229,14 @@ namespace cpp {
         return result;
     }
 
-    token_t DirectiveParser::parseDefine() {
-        const auto &name = input()->expectId()->value();
+    void DirectiveParser::define(std::shared_ptr<Macro> macro, const PosInfo &pos) {
+        macroTable()->define(macro, pos);
+        if (options()->callbacks)
+            options()->callbacks->macroDefined(*macro, pos);
+    }
+
+    token_t DirectiveParser::parseDefine(const PosInfo &pos) {
+        auto name = input()->expectId()->value();
         if (input()->matchPunc('(')) {
             input()->space(false);
             bool first = true;
@@ -124,7 +244,7 @@ namespace cpp {
             while (!input()->finished()) {
                 if (input()->matchPunc(')')) {
                     macro->setBody(readLine());
-                    (*macroTable())[name] = macro;
+                    define(macro, pos);
                     return truncateLine(input()->expectNewLine());
                 } else {
                     if (first) {
@@ -138,7 +258,7 @@ namespace cpp {
                         input()->space(false);
                         input()->expectPunc(')');
                         macro->setBody(readLine(true));
-                        (*macroTable())[name] = macro;
+                        define(macro, pos);
                         return truncateLine(input()->expectNewLine());
                     } else {
                         macro->addParam(input()->expectId()->value());
@@ -152,21 +272,20 @@ namespace cpp {
                 throw ParsingException("Expected space", token->pos());
             }
             auto macro = std::make_shared<Macro>(name);
-            (*macroTable())[name] = macro;
             if (token && !token->hasNewLine()) {
                 macro->setBody(readLine());
                 token = input()->expectNewLine();
             }
+            define(macro, pos);
             return truncateLine(token);
         }
     }
 
-    token_t DirectiveParser::parseUndef() {
-        const auto &name = input()->expectId()->value();
-        auto it = macroTable()->find(name);
-        if (it != macroTable()->end()) {
-            macroTable()->erase(it);
-        }
+    token_t DirectiveParser::parseUndef(const PosInfo &pos) {
+        auto name = input()->expectId()->value();
+        macroTable()->undef(name);
+        if (options()->callbacks)
+            options()->callbacks->macroUndefined(name, pos);
         return truncateLine(input()->expectNewLine());
     }
 
@@ -174,10 +293,13 @@ namespace cpp {
         input()->space(false);
         bool cond;
         if (defined) {
-            const auto &name = input()->expectId()->value();
-            cond = (bool) (*macroTable())[name] != neg;
+            auto name = input()->expectId()->value();
+            cond = (bool) macroTable()->find(name) != neg;
+        } else if (shouldIgnore(ifStack)) {
+            readLine();
+            cond = false;
         } else {
-            cond = parseCondition(readLine(), macroTable(), stack());
+            cond = parseCondition(readLine(), macroTable(), stack(), options());
         }
         if (shouldIgnore(ifStack))
             ifStack.push_back(3);
@@ -190,16 +312,17 @@ namespace cpp {
 
     token_t DirectiveParser::parseElif(const PosInfo &pos) {
         input()->space(false);
-        bool cond = parseCondition(readLine(), macroTable(), stack());
+        auto line = readLine();
 
         auto state = 0;
         if (ifStack.empty())
             throw ParsingException("Unexpected #elif", pos);
         else
             state = ifStack.back();
+        // the condition only matters if no earlier group was taken
         if (state == 1)
-            ifStack.back() = 2;
-        else if (state == 2 && cond)
+            ifStack.back() = 3;
+        else if (state == 2 && parseCondition(line, macroTable(), stack(), options()))
             ifStack.back() = 1;
         else if (state > 3)
             throw ParsingException("Unexpected #elif", pos);
@@ -235,13 +358,13 @@ namespace cpp {
         return truncateLine(input()->expectNewLine());
     }
 
-    token_t DirectiveParser::parseInclude(const PosInfo &pos) {
+    token_t DirectiveParser::parseInclude(const PosInfo &pos, bool next) {
         auto token = input()->next();
         if (!token)
             throw ParsingException("Expected '\"' or '<'", getPos());
         if (token->type() == Token::STRING) {
             std::string path(token->value().substr(1, token->value().size() - 2));
-            return include(path, pos, expectNewLine(), true);
+            return include(path, pos, expectNewLine(), true, next);
         } else if (token->value()[0] == '<') {
             std::string path(token->value().substr(1));
             while (token = input()->next()) {
@@ -255,7 +378,7 @@ namespace cpp {
                     throw ParsingException(("Unexpected: " + v.substr(i + 1)).c_str(), token->pos() + (i + 1));
                 } else {
                     path += v.substr(0, i);
-                    return include(path, pos, expectNewLine(), false);
+                    return include(path, pos, expectNewLine(), false, next);
                 }
             }
             throw ParsingException("Expected >", getPos());
@@ -264,41 +387,54 @@ namespace cpp {
         }
     }
 
-    namespace {
-        void resolve(const std::string &base, const std::string &path, std::string &result) {
-            if (path[0] == '/') {
-                result = path;
-            } else {
-                auto i = base.rfind('/');
-                if (i == std::string::npos) {
-                    result = path;
-                } else {
-                    result = base.substr(0, i + 1) + path;
-                }
-            }
-        }
-    }
-
-    token_t DirectiveParser::include(const std::string &path, const PosInfo &pos, token_t space, bool isQuote) {
-        if (recursionDepth >= MAX_INCLUDE_RECURSION) {
+    token_t DirectiveParser::include(const std::string &path, const PosInfo &pos, token_t space, bool isQuote, bool next) {
+        if (depth() >= options()->maxIncludeDepth) {
             std::cerr << "Reached max include recursion depth";
             return truncateLine(space);
         }
-        if (isQuote) {
-            std::string result;
+        std::string result;
+        std::shared_ptr<TokenStream> tokenizer;
+        // #include_next in a file not found on the include paths acts as #include
+        auto after = next && pathIndex >= 0;
+        long found = -1;
+        if (isQuote && !after) {
             resolve(file(), path, result);
-            auto input = std::make_shared<std::ifstream>();
-            input->open(result);
-            if (input->is_open()) {
-                auto tokenizer = std::make_shared<Tokenizer>(input, result);
-                auto dirParser = std::make_shared<DirectiveParser>(tokenizer, macroTable(), stack(), result, recursionDepth + 1);
-                included = std::make_shared<MacroExpander>(dirParser, macroTable(), stack());
-                return _next();
-            } else {
-                std::cerr << "Open file failed: " << result << std::endl;
+            tokenizer = openSource(result, options());
+        }
+        if (!tokenizer && path[0] != '/') {
+            const auto &dirs = options()->includePaths;
+            for (auto i = after? pathIndex + 1: 0; i<(long) dirs.size(); i++) {
+                const auto &dir = dirs[i];
+                auto candidate = dir.empty() || dir.back() == '/'? dir + path: dir + "/" + path;
+                if ((tokenizer = openSource(candidate, options()))) {
+                    result = candidate;
+                    found = i;
+                    break;
+                }
             }
         }
-        std::string v("#include ");
+        if (tokenizer) {
+            if (options()->callbacks)
+                options()->callbacks->includeEnter(result, pos);
+            frames.push_back(IncludeFrame());
+            auto &frame = frames.back();
+            frame.input = input();
+            frame.file = std::move(_file);
+            frame.ifStack = std::move(ifStack);
+            frame.lineStart = lineStart;
+            frame.emitted = emitted;
+            frame.pathIndex = pathIndex;
+            setInput(tokenizer);
+            _file = result;
+            ifStack.clear();
+            lineStart = true;
+            emitted = 0;
+            pathIndex = found;
+            return nextInFile();
+        } else if (isQuote) {
+            std::cerr << "Open file failed: " << result << std::endl;
+        }
+        std::string v(next? "#include_next ": "#include ");
         v.push_back(isQuote? '"': '<');
         v += path;
         v.push_back(isQuote? '"': '>');
@@ -0,0 +1,190 @@
+#include "preprocessor.h"
+#include <algorithm>
+
+namespace cpp {
+    namespace {
+        /*
+         * Walks a file the way the Tokenizer splits it, to tell directive
+         * lines from the rest. Whatever is dropped leaves its line breaks
+         * behind, so the directives keep their lines.
+         */
+        class Minimizer {
+        public:
+            inline Minimizer(const char *data, unsigned long size, std::string &o):
+                    p(data), e(data + size), line(data), out(o), lineStart(true) {}
+
+            void run() {
+                while (p < e) {
+                    auto c = *p;
+                    if (lineBreak()) {
+                        lineStart = true;
+                    } else if (c == ' ' || c == '\t') {
+                        p++;
+                    } else if (comment(true) || splice(true)) {
+                    } else if (c == '#' && lineStart) {
+                        directive();
+                    } else {
+                        lineStart = false;
+                        token(true);
+                    }
+                }
+            }
+        private:
+            /* a line break at p, \r\n counting once, written out */
+            inline bool lineBreak() {
+                if (*p == '\r') {
+                    p++;
+                    if (p < e && *p == '\n')
+                        p++;
+                } else if (*p == '\n') {
+                    p++;
+                } else {
+                    return false;
+                }
+                out.push_back('\n');
+                line = p;
+                return true;
+            }
+
+            /* moves past a backslash and line break at p */
+            inline bool splice(bool blank) {
+                if (*p != '\\' || p + 1 == e || (p[1] != '\n' && p[1] != '\r'))
+                    return false;
+                auto b = p++;
+                lineBreak();
+                if (!blank) {
+                    out.pop_back();
+                    out.append(b, p);
+                }
+                return true;
+            }
+
+            /*
+             * Moves past a comment at p. Dropped comments leave their line
+             * breaks; kept ones are copied along with the directive.
+             */
+            bool comment(bool blank) {
+                if (e - p < 2 || *p != '/' || (p[1] != '*' && p[1] != '/'))
+                    return false;
+                auto block = p[1] == '*';
+                copy(blank, 2);
+                while (p < e) {
+                    if (block && *p == '*') {
+                        copy(blank, 1);
+                        while (p < e && splice(blank));
+                        if (p < e && *p == '/') {
+                            copy(blank, 1);
+                            return true;
+                        }
+                    } else if (!block && (*p == '\n' || *p == '\r')) {
+                        return true;
+                    } else if (blank && (*p == '\n' || *p == '\r')) {
+                        lineBreak();
+                    } else if (!splice(blank)) {
+                        copy(blank, 1);
+                    }
+                }
+                return true;
+            }
+
+            /* an identifier, number, literal or punctuator at p */
+            void token(bool blank) {
+                auto b = p;
+                while (p < e && (isalnum(*p) || *p == '_'))
+                    copy(blank, 1);
+                if (p == e)
+                    return;
+                if (*p == '"' || *p == '\'') {
+                    std::string prefix(b, p);
+                    if (*p == '"' && !prefix.empty() && prefix.back() == 'R' &&
+                            (prefix == "R" || prefix == "u8R" || prefix == "uR" || prefix == "UR" || prefix == "LR")) {
+                        rawString(blank);
+                    } else if (prefix.empty() || prefix == "u8" || prefix == "u" || prefix == "U" || prefix == "L") {
+                        literal(blank);
+                    }
+                } else if (p == b && !splice(blank)) {
+                    copy(blank, 1);
+                }
+            }
+
+            /* a literal up to its quote, or the end of the line if there is none */
+            void literal(bool blank) {
+                auto quote = *p;
+                copy(blank, 1);
+                while (p < e && *p != quote && *p != '\n' && *p != '\r') {
+                    if (splice(blank))
+                        continue;
+                    copy(blank, *p == '\\' && p + 1 < e && p[1] != '\n' && p[1] != '\r'? 2: 1);
+                }
+                if (p < e && *p == quote)
+                    copy(blank, 1);
+            }
+
+            /* a raw string, which takes its bytes as they are */
+            void rawString(bool blank) {
+                auto b = p + 1, delimiter = b;
+                while (delimiter < e && *delimiter != '(' && !strchr(" )\\\t\f\r\n", *delimiter))
+                    delimiter++;
+                if (delimiter == e || *delimiter != '(') {
+                    literal(blank);
+                    return;
+                }
+                std::string terminator(")");
+                terminator.append(b, delimiter);
+                terminator.push_back('"');
+                auto end = std::search(delimiter, e, terminator.begin(), terminator.end());
+                end = end == e? e: end + terminator.size();
+                while (p < end) {
+                    if (!blank || !lineBreak())
+                        copy(blank, 1);
+                }
+            }
+
+            /* a directive and its line, copied as it is */
+            void directive() {
+                // keep the column too, for the positions of errors
+                out.append(p - line, ' ');
+                while (p < e && *p != '\n' && *p != '\r') {
+                    if (!splice(false) && !comment(false))
+                        token(false);
+                }
+            }
+
+            /* moves past n bytes, writing them unless they are blanked */
+            inline void copy(bool blank, unsigned long n) {
+                n = std::min(n, (unsigned long) (e - p));
+                if (!blank)
+                    out.append(p, n);
+                p += n;
+            }
+
+            const char *p, *e;
+            /* where the current physical line starts */
+            const char *line;
+            std::string &out;
+            bool lineStart;
+        };
+    }
+
+    void minimizeDirectives(const char *data, unsigned long size, std::string &out) {
+        out.clear();
+        Minimizer(data, size, out).run();
+    }
+
+    std::shared_ptr<const std::string> DirectiveCache::get(const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(path);
+            if (it != entries.end())
+                return it->second;
+        }
+        // minimize without the lock; a racing get of the same path makes the same text
+        MappedFile file(path);
+        if (!file.isOpen())
+            return std::shared_ptr<const std::string>();
+        auto text = std::make_shared<std::string>();
+        minimizeDirectives(file.data(), file.size(), *text);
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.insert(std::make_pair(path, text)).first->second;
+    }
+}
@@ -0,0 +1,106 @@
+#include "preprocessor.h"
+#include <climits>
+#include <cstdlib>
+#include <sys/stat.h>
+
+namespace cpp {
+    namespace {
+        FileInfo statFile(const std::string &path) {
+            FileInfo info;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || S_ISDIR(st.st_mode))
+                return info;
+            info.exists = true;
+            info.device = (unsigned long) st.st_dev;
+            info.inode = (unsigned long) st.st_ino;
+            info.size = (unsigned long) st.st_size;
+            info.mtime = (long) st.st_mtime;
+            return info;
+        }
+
+        inline bool same(const FileInfo &a, const FileInfo &b) {
+            if (a.exists != b.exists)
+                return false;
+            return !a.exists || (a.device == b.device && a.inode == b.inode &&
+                                 a.size == b.size && a.mtime == b.mtime);
+        }
+    }
+
+    std::shared_ptr<FileSystemCache> FileSystemCache::shared() {
+        static auto cache = std::make_shared<FileSystemCache>();
+        return cache;
+    }
+
+    FileInfo FileSystemCache::lookup(const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            lookups++;
+            auto it = entries.find(path);
+            if (it != entries.end()) {
+                hits++;
+                if (!it->second.exists)
+                    negativeHits++;
+                return it->second;
+            }
+        }
+        // stat without the lock; a racing lookup of the same path stores the same answer
+        auto info = statFile(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[path] = info;
+        return info;
+    }
+
+    std::string FileSystemCache::canonical(const std::string &path) {
+        if (!lookup(path).exists)
+            return "";
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(path);
+            if (it != entries.end() && !it->second.canonical.empty())
+                return it->second.canonical;
+        }
+        char buffer[PATH_MAX];
+        std::string result(realpath(path.c_str(), buffer)? buffer: path);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(path);
+        if (it != entries.end())
+            it->second.canonical = result;
+        return result;
+    }
+
+    void FileSystemCache::invalidate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+    }
+
+    void FileSystemCache::invalidate(const std::string &path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.erase(path);
+    }
+
+    unsigned long FileSystemCache::revalidate() {
+        std::vector<std::pair<std::string, FileInfo>> cached;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cached.assign(entries.begin(), entries.end());
+        }
+        unsigned long changed = 0;
+        for (const auto &entry: cached) {
+            if (!same(entry.second, statFile(entry.first))) {
+                invalidate(entry.first);
+                changed++;
+            }
+        }
+        return changed;
+    }
+
+    FileSystemCache::Stats FileSystemCache::stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats result;
+        result.lookups = lookups;
+        result.hits = hits;
+        result.negativeHits = negativeHits;
+        result.syscallsSaved = (long) negativeHits - (long) (lookups - hits);
+        return result;
+    }
+}
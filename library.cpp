@@ -0,0 +1,189 @@
+#include "preprocessor.h"
+
+namespace cpp {
+    namespace {
+        /* reads a stream to its end for what it does on the way, like defining macros */
+        void drain(TokenStream &stream) {
+            token_t tokens[TOKEN_BATCH_SIZE];
+            while (auto count = stream.nextBatch(tokens, TOKEN_BATCH_SIZE)) {
+                for (unsigned long i = 0; i<count; i++)
+                    tokens[i].reset();
+            }
+        }
+    }
+
+    Preprocessor::Preprocessor(options_t o):
+            _options(o? o: std::make_shared<Options>()), _macroTable(std::make_shared<MacroTable>(_options->memory)),
+            predefined(), file(), input() {}
+
+    void Preprocessor::addIncludePath(const std::string &path) {
+        _options->includePaths.push_back(path);
+    }
+
+    void Preprocessor::define(const std::string &name, const std::string &value) {
+        predefined += "#define " + name + " " + value + "\n";
+    }
+
+    void Preprocessor::undef(const std::string &name) {
+        predefined += "#undef " + name + "\n";
+    }
+
+    void Preprocessor::addForcedInclude(const std::string &path) {
+        predefined += "#include \"" + path + "\"\n";
+    }
+
+    void Preprocessor::setCallbacks(std::shared_ptr<PreprocessorCallbacks> callbacks) {
+        _options->callbacks = callbacks;
+    }
+
+    void Preprocessor::setInput(const std::string &f) {
+        file = f;
+        input.reset();
+    }
+
+    void Preprocessor::setInput(std::shared_ptr<std::istream> i, const std::string &f) {
+        file = f;
+        input = i;
+    }
+
+    void Preprocessor::prepare() {
+        if (predefined.empty())
+            return;
+        auto tokenizer = std::make_shared<Tokenizer>(
+                std::make_shared<MemoryStream>(predefined.data(), predefined.size()), "<command line>");
+        DirectiveParser parser(tokenizer, _macroTable, std::shared_ptr<MacroStack>(), "<command line>", 0, _options);
+        drain(parser);
+        predefined.clear();
+    }
+
+    std::shared_ptr<Preprocessor> Preprocessor::fork() {
+        return fork(_options);
+    }
+
+    std::shared_ptr<Preprocessor> Preprocessor::fork(options_t options) {
+        prepare();
+        auto result = std::make_shared<Preprocessor>(options);
+        result->_macroTable = _macroTable->fork();
+        return result;
+    }
+
+    namespace {
+        /* collects tokens into records, keeping the tokens alive until the batch is handed out */
+        class Batch {
+        public:
+            inline Batch(TokenSink &s):
+                    sink(s), count(0), prev(nullptr), last() {}
+
+            /* takes the tokens the stream has into the batch, false at its end */
+            bool read(TokenStream &stream) {
+                auto end = count + stream.nextBatch(tokens + count, PREPROCESSOR_BATCH_SIZE - count);
+                if (end == count)
+                    return false;
+                for (; count<end; count++) {
+                    const auto &token = *tokens[count];
+                    records[count].kind = token.type();
+                    records[count].leadingSpace = spaceBefore(prev, token);
+                    records[count].spelling = token.value().data();
+                    records[count].size = token.value().size();
+                    records[count].pos = &token.pos();
+                    prev = &token;
+                }
+                if (count == PREPROCESSOR_BATCH_SIZE)
+                    flush();
+                return true;
+            }
+
+            inline void flush() {
+                if (count == 0)
+                    return;
+                sink.tokens(records, count);
+                last = tokens[count - 1];
+                prev = last.get();
+                for (unsigned long i = 0; i<count; i++)
+                    tokens[i].reset();
+                count = 0;
+            }
+        private:
+            TokenSink &sink;
+            unsigned long count;
+            token_t tokens[PREPROCESSOR_BATCH_SIZE];
+            TokenRecord records[PREPROCESSOR_BATCH_SIZE];
+            /* the token before the next one, kept alive by last across a flush */
+            const Token *prev;
+            token_t last;
+        };
+    }
+
+    bool Preprocessor::run(TokenSink &sink) {
+        if (_options->memory)
+            _options->memory->resetPeak();
+        prepare();
+        auto stack = std::shared_ptr<MacroStack>();
+
+        std::shared_ptr<TokenStream> tokenizer;
+        if (input)
+            tokenizer = makeTokenizer(input, file, _options);
+        else
+            tokenizer = openSource(file, _options);
+        if (!tokenizer)
+            return false;
+
+        auto dirParser = std::make_shared<DirectiveParser>(tokenizer, _macroTable, stack, file, 0, _options);
+        MacroExpander expander(dirParser, _macroTable, stack, _options);
+        Batch batch(sink);
+        try {
+            while (batch.read(expander));
+        } catch (ParsingException &) {
+            batch.flush();
+            throw;
+        }
+        batch.flush();
+        return true;
+    }
+
+    bool Preprocessor::runDirectives() {
+        if (_options->memory)
+            _options->memory->resetPeak();
+        prepare();
+        // the includes share these options, so they skip their text too
+        auto options = std::make_shared<Options>(*_options);
+        options->skipText = true;
+
+        std::shared_ptr<TokenStream> tokenizer;
+        if (input)
+            tokenizer = makeTokenizer(input, file, options);
+        else
+            tokenizer = openSource(file, options);
+        if (!tokenizer)
+            return false;
+
+        DirectiveParser parser(tokenizer, _macroTable, std::shared_ptr<MacroStack>(), file, 0, options);
+        drain(parser);
+        return true;
+    }
+
+    void writeDefines(std::ostream &os, const MacroTable &table) {
+        for (const auto &entry: table.visible()) {
+            const auto &macro = *entry.second;
+            os << "#define " << macro.name();
+            if (macro.isFunctionLike()) {
+                const auto &params = static_cast<const FunctionMacro&>(macro).params();
+                os << '(';
+                for (unsigned long i = 0; i<params.size(); i++) {
+                    if (i)
+                        os << ',';
+                    os << (params[i] == "__VA_ARGS__"? "...": params[i]);
+                }
+                os << ')';
+            }
+            if (!macro.empty())
+                os << ' ';
+            for (const auto &token: macro.body()) {
+                if (token->leadingSpace())
+                    os << ' ';
+                os << token->value();
+            }
+            os << '\n';
+        }
+    }
+}
@@ -1,8 +1,19 @@
 #include "preprocessor.h"
 
 namespace cpp {
+    MacroExpander::MacroExpander(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s, options_t o):
+            MacroProcessor(i, t, s, o), source(), expander(), pendingSpace(false) {
+        source.reset(i.get());
+    }
+
     token_t MacroExpander::_next() {
-        return __next();
+        auto token = __next();
+        if (pendingSpace && token) {
+            pendingSpace = false;
+            if (token->type() != Token::WHITESPACE)
+                token = withLeadingSpace(token, true);
+        }
+        return token;
     }
 
     token_t MacroExpander::__next(bool enableMacro) {
@@ -14,7 +25,7 @@ namespace cpp {
                 expander.reset();
             }
         }
-        auto token = input()->next();
+        auto token = source.next();
         if (enableMacro && token &&
             token->type() == Token::IDENTIFIER) {
             return expandMacro(token);
@@ -26,11 +37,14 @@ namespace cpp {
         if (name->value() == "__VA_ARGS__")
             throw ParsingException("Unexpected __VA_ARGS__", name->pos());
         if ((!stack() || !(stack()->hasName(name->value()))) && macroTable()) {
-            auto macro = (*macroTable())[name->value()];
+            auto macro = macroTable()->find(name->value());
             if (macro) {
                 if (macro->isFunctionLike()) {
                     return expandFunctionMacro(name, *static_cast<FunctionMacro*>(macro.get()));
                 } else {
+                    if (options()->callbacks)
+                        options()->callbacks->macroExpanded(*macro, name->pos());
+                    pendingSpace = pendingSpace || name->leadingSpace();
                     return expandObjectMacro(*macro);
                 }
             }
@@ -39,16 +53,13 @@ namespace cpp {
     }
 
     namespace {
+        /* appends token, turning the whitespace before it into its leading space */
         void appendToken(std::deque<token_t> &list, token_t token, bool &ws) {
             if (token->type() == Token::WHITESPACE) {
                 ws = true;
             } else {
-                if (ws) {
-                    if (!list.empty())
-                        list.push_back(std::make_shared<Token>(Token::WHITESPACE, " ", token->pos()));
-                    ws = false;
-                }
-                list.push_back(token);
+                list.push_back(withLeadingSpace(token, (ws || token->leadingSpace()) && !list.empty()));
+                ws = false;
             }
         }
 
@@ -68,13 +79,8 @@ namespace cpp {
     }
 
     token_t MacroExpander::expandObjectMacro(const Macro &macro) {
-        if (!macro.empty()) {
-            std::deque<token_t> result;
-            bool ws = false;
-            appendTokens(result, std::make_shared<std::deque<token_t>>(macro.body()), ws);
-            auto stream = std::make_shared<TokenStream>(result);
-            expander = std::make_shared<MacroExpander>(stream, macroTable(), std::make_shared<MacroStack>(macro.name(), stack()));
-        }
+        if (!macro.empty())
+            expandBody(macro, {}, {});
         return _next();
     }
 
@@ -83,31 +89,42 @@ namespace cpp {
         if (input()->matchPunc('(')) {
             input()->space();
             std::vector<std::shared_ptr<std::deque<token_t>>> args;
+            std::vector<bool> spaced(1, false);
             auto curArg = std::make_shared<std::deque<token_t>>();
+            BudgetCharge charge(options()->memory);
             int depth = 0;
             while (!input()->finished()) {
                 if ((token = input()->matchPunc(')'))) {
                     if (depth == 0) {
-                        args.push_back(scanArg(curArg));
-
-                        auto stream = std::make_shared<TokenStream>(subBody(macro, args));
-                        expander = std::make_shared<MacroExpander>(stream, macroTable(), std::make_shared<MacroStack>(macro.name(), stack()));
+                        args.push_back(curArg);
+                        if (options()->callbacks)
+                            options()->callbacks->macroExpanded(macro, name->pos());
+                        pendingSpace = pendingSpace || name->leadingSpace();
+                        expandBody(macro, args, spaced);
                         return _next();
                     } else {
                         depth--;
+                        charge.charge(*token);
                         curArg->push_back(token);
                     }
                 } else if ((token = input()->matchPunc('('))) {
                     depth++;
+                    charge.charge(*token);
                     curArg->push_back(token);
                 } else if (depth == 0 && input()->matchPunc(',')) {
-                    input()->space();
-                    args.push_back(scanArg(curArg));
+                    bool space = (bool) input()->space();
+                    if (!space && (token = input()->next())) {
+                        space = token->leadingSpace();
+                        input()->unget(token);
+                    }
+                    spaced.push_back(space);
+                    args.push_back(curArg);
                     curArg = std::make_shared<std::deque<token_t>>();
                 } else {
                     token = input()->next();
                     if (!token)
                         break;
+                    charge.charge(*token);
                     curArg->push_back(token);
                 }
             }
@@ -119,6 +136,54 @@ namespace cpp {
         }
     }
 
+    namespace {
+        inline void appendKey(std::string &key, const std::string &v) {
+            key += v;
+            key.push_back('\0');
+        }
+    }
+
+    void MacroExpander::expandBody(const Macro &macro,
+                                   const std::vector<std::shared_ptr<std::deque<token_t>>> &args,
+                                   const std::vector<bool> &spaced) {
+        auto macroStack = std::make_shared<MacroStack>(macro.name(), stack());
+        // a cached expansion replays its tokens without the callbacks of the macros inside
+        if (!options()->cacheExpansions || options()->callbacks) {
+            auto stream = std::make_shared<TokenStream>(subBody(macro, args, spaced));
+            expander = std::make_shared<MacroExpander>(stream, macroTable(), macroStack, options());
+            return;
+        }
+
+        // what the expansion depends on besides the table: the macro,
+        // the names hidden from it and its arguments as written
+        const Macro *id = &macro;
+        std::string key(reinterpret_cast<const char*>(&id), sizeof(id));
+        for (auto s = stack(); s; s = s->cdr)
+            appendKey(key, s->car);
+        key.push_back('\1');
+        for (unsigned long i = 0; i<args.size(); i++) {
+            key.push_back(spaced[i]? '\2': '\3');
+            for (auto token: *args[i]) {
+                key.push_back((char) (token->type() | token->leadingSpace() << 4));
+                appendKey(key, token->value());
+            }
+        }
+
+        auto &cache = macroTable()->expansions();
+        auto generation = macroTable()->generation();
+        auto tokens = cache.find(key, generation);
+        if (!tokens) {
+            auto stream = std::make_shared<TokenStream>(subBody(macro, args, spaced));
+            MacroExpander nested(stream, macroTable(), macroStack, options());
+            auto result = std::make_shared<std::vector<token_t>>();
+            while (auto token = nested.next())
+                result->push_back(token);
+            tokens = result;
+            cache.insert(key, generation, tokens);
+        }
+        expander = std::make_shared<TokenRange>(tokens);
+    }
+
     std::shared_ptr<std::deque<token_t>> MacroExpander::scanArg(std::shared_ptr<std::deque<token_t>> arg) {
         auto expander = makeExpander(*arg);
         std::shared_ptr<std::deque<token_t>> newArg = std::make_shared<std::deque<token_t>>();
@@ -128,48 +193,193 @@ namespace cpp {
         return newArg;
     }
 
+    namespace {
+        inline bool isPunc(token_t token, const char *v) {
+            return token->type() == Token::PUNC && token->value() == v;
+        }
+
+        inline bool isPaste(token_t token) {
+            return isPunc(token, "##") || isPunc(token, "%:%:");
+        }
+
+        inline bool isStringize(token_t token) {
+            return isPunc(token, "#") || isPunc(token, "%:");
+        }
+
+        /* the spelling of arg as a string literal, built in place */
+        token_t stringize(const std::deque<token_t> &arg, const PosInfo &pos) {
+            std::string s("\"");
+            bool ws = false;
+            for (auto token: arg) {
+                if (token->type() == Token::WHITESPACE) {
+                    ws = true;
+                    continue;
+                }
+                if ((ws || token->leadingSpace()) && s.size() > 1)
+                    s.push_back(' ');
+                ws = false;
+                const std::string &v = token->value();
+                if (token->type() == Token::STRING || token->type() == Token::CHARACTER) {
+                    for (auto c: v) {
+                        if (c == '"' || c == '\\')
+                            s.push_back('\\');
+                        s.push_back(c);
+                    }
+                } else {
+                    s += v;
+                }
+            }
+            s.push_back('"');
+            return std::make_shared<Token>(Token::STRING, s, pos);
+        }
+
+        /* one operand of the body, with the whitespace before it */
+        class Piece {
+        public:
+            inline Piece(bool w):
+                    ws(w), tokens() {}
+
+            bool ws;
+            std::deque<token_t> tokens;
+        };
+
+        void trim(std::deque<token_t> &tokens) {
+            while (!tokens.empty() && tokens.front()->type() == Token::WHITESPACE)
+                tokens.pop_front();
+            while (!tokens.empty() && tokens.back()->type() == Token::WHITESPACE)
+                tokens.pop_back();
+        }
+    }
+
+    token_t MacroExpander::paste(token_t lhs, token_t rhs) {
+        const std::string &l = lhs->value(), &r = rhs->value();
+        auto n = l.size() + r.size();
+        char stackBuffer[256];
+        std::string heapBuffer;
+        char *buffer = stackBuffer;
+        if (n > sizeof(stackBuffer)) {
+            heapBuffer.resize(n);
+            buffer = &heapBuffer[0];
+        }
+        memcpy(buffer, l.data(), l.size());
+        memcpy(buffer + l.size(), r.data(), r.size());
+        Token::token_type type;
+        if (!isSingleToken(buffer, n, type))
+            throw ParsingException(("Pasting \"" + l + "\" and \"" + r + "\" does not give a valid preprocessing token").c_str(), lhs->pos());
+        return std::make_shared<Token>(type, std::string(buffer, n), lhs->pos(), false, lhs->leadingSpace());
+    }
+
     std::deque<token_t>
-    MacroExpander::subBody(const FunctionMacro &macro,
-                           const std::vector<std::shared_ptr<std::deque<token_t>>> &args) {
-        const auto &params = macro.params();
+    MacroExpander::subBody(const Macro &macro,
+                           const std::vector<std::shared_ptr<std::deque<token_t>>> &args,
+                           const std::vector<bool> &spaced) {
+        static const std::deque<std::string> noParams;
+        bool isFunction = macro.isFunctionLike();
+        const auto &params = isFunction? static_cast<const FunctionMacro&>(macro).params(): noParams;
         auto l = params.size();
 
         bool hasVAARGS = l > 0 && params[l-1] == "__VA_ARGS__";
-        if (l == 0 && args.size() == 1 &&
+        if (!isFunction) {
+        } else if (l == 0 && args.size() == 1 &&
                     ((args[0]->size() == 1 && (*args[0])[0]->type() == Token::WHITESPACE) ||
                     args[0]->size() == 0)) {
         } else if (hasVAARGS? args.size() < l-1: args.size() != l) {
             throw ParsingException("Too few args", getPos());
         }
 
-        bool ws = false;
-        std::deque<token_t> result;
+        std::vector<std::shared_ptr<std::deque<token_t>>> expanded(args.size());
+        auto expandedArg = [&](unsigned long i) {
+            if (!expanded[i])
+                expanded[i] = scanArg(args[i]);
+            return expanded[i];
+        };
+        auto rawArg = [&](unsigned long i) {
+            auto arg = std::make_shared<std::deque<token_t>>(*args[i]);
+            trim(*arg);
+            return arg;
+        };
 
-        for (auto token: macro.body()) {
-            if (token->type() == Token::IDENTIFIER) {
-                if (token->value() == "__VA_ARGS__") {
-                    if (!hasVAARGS)
-                        throw ParsingException("Unexpected __VA_ARGS__", token->pos());
-                    auto comma = std::make_shared<Token>(Token::PUNC, ",", PosInfo(token->pos()));
-                    for (auto i = l-1; i<args.size(); i++) {
-                        if (i > l-1) {
-                            appendToken(result, comma, ws);
-                            ws = true;
-                        }
-                        appendTokens(result, args[i], ws);
+        std::vector<token_t> body(macro.body().begin(), macro.body().end());
+        if (!body.empty() && (isPaste(body.front()) || isPaste(body.back())))
+            throw ParsingException("'##' cannot appear at either end of a macro expansion",
+                                   isPaste(body.front())? body.front()->pos(): body.back()->pos());
+
+        auto paramIndex = [&](token_t token) -> long {
+            if (!isFunction || token->type() != Token::IDENTIFIER)
+                return -1;
+            if (token->value() == "__VA_ARGS__") {
+                if (!hasVAARGS)
+                    throw ParsingException("Unexpected __VA_ARGS__", token->pos());
+                return (long) l - 1;
+            }
+            return findParam(params, token->value());
+        };
+
+        std::vector<Piece> pieces;
+        bool pasting = false;
+        for (unsigned long j = 0; j<body.size(); j++) {
+            auto token = body[j];
+            if (isPaste(token)) {
+                pasting = true;
+                continue;
+            }
+            Piece piece(token->leadingSpace());
+            long i;
+            if (isFunction && isStringize(token)) {
+                if (j + 1 >= body.size() || (i = paramIndex(body[j + 1])) < 0)
+                    throw ParsingException("'#' is not followed by a macro parameter", token->pos());
+                j++;
+                std::deque<token_t> spelling;
+                for (auto k = (unsigned long) i; k<args.size(); k++) {
+                    if (k > (unsigned long) i) {
+                        spelling.push_back(std::make_shared<Token>(Token::PUNC, ",", token->pos()));
+                        if (spaced[k])
+                            spelling.push_back(std::make_shared<Token>(Token::WHITESPACE, " ", token->pos()));
                     }
-                } else {
-                    int i = findParam(params, token->value());
-                    if (i >= 0) {
-                        appendTokens(result, args[i], ws);
-                    } else {
-                        appendToken(result, token, ws);
+                    auto arg = rawArg(k);
+                    spelling.insert(spelling.end(), arg->begin(), arg->end());
+                    if (!hasVAARGS || (unsigned long) i != l-1)
+                        break;
+                }
+                piece.tokens.push_back(stringize(spelling, token->pos()));
+            } else if ((i = paramIndex(token)) >= 0) {
+                bool raw = pasting || (j + 1 < body.size() && isPaste(body[j + 1]));
+                bool argWs = false;
+                for (auto k = (unsigned long) i; k<args.size(); k++) {
+                    if (k > (unsigned long) i) {
+                        appendToken(piece.tokens, std::make_shared<Token>(Token::PUNC, ",", token->pos()), argWs);
+                        argWs = true;
                     }
+                    appendTokens(piece.tokens, raw? rawArg(k): expandedArg(k), argWs);
+                    if (!hasVAARGS || (unsigned long) i != l-1)
+                        break;
                 }
             } else {
-                appendToken(result, token, ws);
+                piece.tokens.push_back(token);
+            }
+
+            if (pasting) {
+                pasting = false;
+                auto &last = pieces.back();
+                if (last.tokens.empty()) {
+                    last.tokens = piece.tokens;
+                } else if (!piece.tokens.empty()) {
+                    last.tokens.back() = paste(last.tokens.back(), piece.tokens.front());
+                    last.tokens.insert(last.tokens.end(), piece.tokens.begin() + 1, piece.tokens.end());
+                }
+            } else {
+                pieces.push_back(piece);
             }
         }
+
+        std::deque<token_t> result;
+        bool ws = false;
+        for (const auto &piece: pieces) {
+            if (piece.ws)
+                ws = true;
+            for (auto token: piece.tokens)
+                appendToken(result, token, ws);
+        }
         return result;
     }
-}
\ No newline at end of file
+}
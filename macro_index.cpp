@@ -0,0 +1,205 @@
+#include "preprocessor.h"
+#include <algorithm>
+
+namespace cpp {
+    namespace {
+        inline void putFixed(std::string &out, unsigned long v, int bytes) {
+            for (int i = 0; i<bytes; i++)
+                out.push_back((char) (v >> (8 * i) & 0xff));
+        }
+
+        inline unsigned long getFixed(const char *p, int bytes) {
+            unsigned long v = 0;
+            for (int i = 0; i<bytes; i++)
+                v |= (unsigned long) (unsigned char) p[i] << (8 * i);
+            return v;
+        }
+
+        inline void corrupt() {
+            throw ParsingException("Corrupt macro index", posStart);
+        }
+
+        class Strings {
+        public:
+            inline Strings():
+                    ids(), offsets(1, 0), data() {}
+
+            unsigned long intern(const std::string &s) {
+                auto result = ids.insert(std::make_pair(s, ids.size()));
+                if (result.second) {
+                    data += s;
+                    offsets.push_back(data.size());
+                }
+                return result.first->second;
+            }
+
+            std::unordered_map<std::string, unsigned long> ids;
+            std::vector<unsigned long> offsets;
+            std::string data;
+        };
+
+        /* an entry waiting to be written, with its strings interned */
+        class Pending {
+        public:
+            unsigned long kind, file, line, col, unit;
+        };
+    }
+
+    MacroIndexReader::MacroIndexReader(const char *d, unsigned long size):
+            data(d), names(), offsets(), strings(), entries(), _nameCount(0), stringCount(0), entryCount(0) {
+        if (size < INDEX_HEADER_SIZE || memcmp(data, INDEX_MAGIC, 8) != 0)
+            corrupt();
+        _nameCount = getFixed(data + 8, 4);
+        stringCount = getFixed(data + 12, 4);
+        entryCount = getFixed(data + 16, 8);
+        auto stringBytes = getFixed(data + 24, 8);
+        auto nameBytes = _nameCount * INDEX_NAME_SIZE, offsetBytes = (stringCount + 1) * 4;
+        auto rest = size - INDEX_HEADER_SIZE;
+        if (rest < nameBytes || (rest -= nameBytes) < offsetBytes || (rest -= offsetBytes) < stringBytes ||
+                rest - stringBytes != entryCount * INDEX_ENTRY_SIZE)
+            corrupt();
+        names = data + INDEX_HEADER_SIZE;
+        offsets = names + nameBytes;
+        strings = offsets + offsetBytes;
+        entries = strings + stringBytes;
+        // every string must lie within the string data
+        unsigned long last = 0;
+        for (unsigned long i = 0; i<=stringCount; i++) {
+            auto offset = getFixed(offsets + i * 4, 4);
+            if (offset < last || offset > stringBytes)
+                corrupt();
+            last = offset;
+        }
+        if (last != stringBytes)
+            corrupt();
+    }
+
+    void MacroIndexReader::string(unsigned long id, const char *&s, unsigned long &n) const {
+        if (id >= stringCount)
+            corrupt();
+        auto begin = getFixed(offsets + id * 4, 4);
+        s = strings + begin;
+        n = getFixed(offsets + id * 4 + 4, 4) - begin;
+    }
+
+    void MacroIndexReader::name(unsigned long i, const char *&s, unsigned long &n,
+                                unsigned long &first, unsigned long &count) const {
+        auto p = names + i * INDEX_NAME_SIZE;
+        string(getFixed(p, 4), s, n);
+        first = getFixed(p + 4, 4);
+        count = getFixed(p + 8, 4);
+        if (first > entryCount || count > entryCount - first)
+            corrupt();
+    }
+
+    bool MacroIndexReader::find(const std::string &key, unsigned long &first, unsigned long &count) const {
+        unsigned long lo = 0, hi = _nameCount;
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            const char *s;
+            unsigned long n;
+            name(mid, s, n, first, count);
+            auto c = memcmp(s, key.data(), std::min(n, (unsigned long) key.size()));
+            if (c == 0)
+                c = n < key.size()? -1: n > key.size()? 1: 0;
+            if (c == 0)
+                return true;
+            if (c < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return false;
+    }
+
+    void MacroIndexReader::entry(unsigned long i, MacroIndexEntry &entry) const {
+        auto p = entries + i * INDEX_ENTRY_SIZE;
+        auto kind = getFixed(p, 4);
+        if (kind > MacroUse::EXPAND)
+            corrupt();
+        entry.kind = (MacroUse::use_type) kind;
+        string(getFixed(p + 4, 4), entry.file, entry.fileSize);
+        entry.line = (int) getFixed(p + 8, 4);
+        entry.col = (int) getFixed(p + 12, 4);
+        string(getFixed(p + 16, 4), entry.unit, entry.unitSize);
+    }
+
+    void MacroIndexWriter::load(const MacroIndexReader &reader) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::string, std::vector<MacroUse>> loaded;
+        for (unsigned long i = 0; i<reader.nameCount(); i++) {
+            const char *s;
+            unsigned long n, first, count;
+            reader.name(i, s, n, first, count);
+            for (auto j = first; j<first + count; j++) {
+                MacroIndexEntry entry;
+                reader.entry(j, entry);
+                MacroUse use;
+                use.kind = entry.kind;
+                use.name.assign(s, n);
+                use.file.assign(entry.file, entry.fileSize);
+                use.line = entry.line;
+                use.col = entry.col;
+                loaded[std::string(entry.unit, entry.unitSize)].push_back(std::move(use));
+            }
+        }
+        // units updated here are newer than the index
+        for (auto &unit: loaded)
+            units.insert(std::move(unit));
+    }
+
+    void MacroIndexWriter::update(const std::string &unit, std::vector<MacroUse> &&uses) {
+        // a unit left empty is kept, so a later load does not bring it back
+        std::lock_guard<std::mutex> lock(mutex);
+        units[unit] = std::move(uses);
+    }
+
+    void MacroIndexWriter::write(std::ostream &os) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Strings strings;
+        std::map<std::string, std::vector<Pending>> byName;
+        for (const auto &unit: units) {
+            if (unit.second.empty())
+                continue;
+            auto unitId = strings.intern(unit.first);
+            for (const auto &use: unit.second) {
+                Pending entry;
+                entry.kind = use.kind;
+                entry.file = strings.intern(use.file);
+                entry.line = (unsigned long) use.line;
+                entry.col = (unsigned long) use.col;
+                entry.unit = unitId;
+                byName[use.name].push_back(entry);
+            }
+        }
+
+        std::string header(INDEX_MAGIC, 8), names, entries;
+        unsigned long entryCount = 0;
+        for (const auto &name: byName) {
+            putFixed(names, strings.intern(name.first), 4);
+            putFixed(names, entryCount, 4);
+            putFixed(names, name.second.size(), 4);
+            for (const auto &entry: name.second) {
+                putFixed(entries, entry.kind, 4);
+                putFixed(entries, entry.file, 4);
+                putFixed(entries, entry.line, 4);
+                putFixed(entries, entry.col, 4);
+                putFixed(entries, entry.unit, 4);
+            }
+            entryCount += name.second.size();
+        }
+        putFixed(header, byName.size(), 4);
+        putFixed(header, strings.ids.size(), 4);
+        putFixed(header, entryCount, 8);
+        putFixed(header, strings.data.size(), 8);
+        std::string offsets;
+        for (auto offset: strings.offsets)
+            putFixed(offsets, offset, 4);
+        os.write(header.data(), header.size());
+        os.write(names.data(), names.size());
+        os.write(offsets.data(), offsets.size());
+        os.write(strings.data.data(), strings.data.size());
+        os.write(entries.data(), entries.size());
+        os.flush();
+    }
+}
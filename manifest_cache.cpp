@@ -0,0 +1,80 @@
+#include "preprocessor.h"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cpp {
+    namespace {
+        const char MANIFEST_MAGIC[] = "cpp-manifest 1";
+    }
+
+    bool replaceFile(const std::string &path, const std::string &data) {
+        auto temp = path + ".tmp" + std::to_string((long) getpid());
+        {
+            std::ofstream out(temp, std::ios_base::out | std::ios_base::binary);
+            if (!out.is_open() || !out.write(data.data(), data.size()))
+                return false;
+        }
+        if (rename(temp.c_str(), path.c_str()) != 0) {
+            std::remove(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    ManifestCache::ManifestCache(const std::string &d):
+            dir(d.empty() || d.back() != '/'? d: d.substr(0, d.size() - 1)) {
+        mkdir(dir.c_str(), 0777);
+    }
+
+    std::string ManifestCache::key(const std::string &input, const std::string &flags) const {
+        auto content = hashFile(input);
+        if (content.empty())
+            return content;
+        // includes are looked up next to the input, so its path counts too
+        auto s = flags + '\0' + input + '\0' + content;
+        return sha256(s.data(), s.size());
+    }
+
+    std::string ManifestCache::lookup(const std::string &key) const {
+        std::ifstream in(dir + "/" + key + ".manifest");
+        std::string line;
+        if (!std::getline(in, line) || line != MANIFEST_MAGIC)
+            return "";
+        while (std::getline(in, line)) {
+            if (line.size() < 66 || line[64] != ' ')
+                return "";
+            auto hash = line.substr(0, 64), path = line.substr(65);
+            if (hash == std::string(64, '-'))
+                return path;
+            if (hashFile(path) != hash)
+                return "";
+        }
+        return "";
+    }
+
+    bool ManifestCache::load(const std::string &hash, std::string &output) const {
+        std::ifstream in(dir + "/" + hash + ".out", std::ios_base::in | std::ios_base::binary);
+        if (!in.is_open())
+            return false;
+        output.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    bool ManifestCache::store(const std::string &key, const std::vector<std::string> &includes,
+                              const std::string &output, const std::string &hash) {
+        std::string manifest(MANIFEST_MAGIC);
+        manifest.push_back('\n');
+        for (const auto &path: includes) {
+            auto content = hashFile(path);
+            if (content.empty())
+                return false;
+            manifest += content + " " + path + "\n";
+        }
+        manifest += std::string(64, '-') + " " + hash + "\n";
+        // the output goes first so a manifest never points at nothing
+        return replaceFile(dir + "/" + hash + ".out", output) && replaceFile(dir + "/" + key + ".manifest", manifest);
+    }
+}
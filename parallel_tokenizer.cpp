@@ -0,0 +1,200 @@
+#include "preprocessor.h"
+#include <algorithm>
+
+namespace cpp {
+    namespace {
+        /*
+         * A chunk is lexed speculatively from its first byte as if that byte
+         * started a token. Whether that guess holds is only known once the
+         * chunk before it has been merged.
+         */
+        class LexedChunk {
+        public:
+            inline LexedChunk(const std::string &f):
+                    begin(0), end(0), stop(0), lines(0), start(f), endPos(f), offsets(), tokens() {}
+
+            unsigned long begin, end;
+            /* offset of the first token not lexed */
+            unsigned long stop;
+            /* line breaks inside [begin, end) */
+            unsigned long lines;
+            /* position assumed at begin, and the lexer position at stop */
+            PosInfo start, endPos;
+            std::vector<unsigned long> offsets;
+            std::vector<token_t> tokens;
+        };
+
+        inline unsigned long offsetOf(std::istream &input, unsigned long size) {
+            if (input.eof())
+                return size;
+            return (unsigned long) input.tellg();
+        }
+
+        inline bool afterReturn(const char *data, unsigned long offset) {
+            return offset > 0 && data[offset - 1] == '\r';
+        }
+
+        /* counts line breaks the way Tokenizer::advanceRaw does */
+        unsigned long countLines(const char *p, const char *e) {
+            unsigned long n = 0;
+            bool ret = false;
+            for (; p < e; p++) {
+                if (*p == '\r') {
+                    n++;
+                    ret = true;
+                } else {
+                    if (*p == '\n' && !ret)
+                        n++;
+                    ret = false;
+                }
+            }
+            return n;
+        }
+
+        void lexChunk(const char *data, unsigned long size, const std::string &file, LexedChunk &chunk) {
+            auto input = std::make_shared<MemoryStream>(data, size);
+            Tokenizer tokenizer(input, file);
+            tokenizer.seek(chunk.begin, chunk.start, false);
+            unsigned long off = chunk.begin;
+            try {
+                while (true) {
+                    off = offsetOf(*input, size);
+                    if (off >= chunk.end)
+                        break;
+                    auto token = tokenizer.next();
+                    if (!token) {
+                        off = size;
+                        break;
+                    }
+                    chunk.offsets.push_back(off);
+                    chunk.tokens.push_back(token);
+                }
+                chunk.stop = off;
+                chunk.endPos = tokenizer.getPos();
+            } catch (ParsingException &) {
+                // Most likely the chunk started inside a comment or literal. Keep
+                // what was lexed and find the position after the last good token.
+                if (chunk.tokens.empty()) {
+                    chunk.stop = chunk.begin;
+                    chunk.endPos = chunk.start;
+                } else {
+                    auto last = chunk.offsets.back();
+                    auto input = std::make_shared<MemoryStream>(data, size);
+                    Tokenizer relex(input, file);
+                    relex.seek(last, chunk.tokens.back()->pos(), afterReturn(data, last));
+                    relex.next();
+                    chunk.stop = offsetOf(*input, size);
+                    chunk.endPos = relex.getPos();
+                }
+            }
+        }
+
+        /* moves a position computed relative to from so that from lands on to */
+        inline PosInfo relocate(const PosInfo &p, const PosInfo &from, const PosInfo &to) {
+            PosInfo result(p);
+            if (p.line == from.line)
+                result.col += to.col - from.col;
+            result.line += to.line - from.line;
+            result.pos += to.pos - from.pos;
+            return result;
+        }
+    }
+
+    std::shared_ptr<LexedTokenStream> tokenizeParallel(const char *data, unsigned long size, const std::string &file, unsigned threads, unsigned long minChunk) {
+        unsigned long n = threads;
+        if (minChunk > 0 && size / minChunk < n)
+            n = size / minChunk;
+        if (n < 1)
+            n = 1;
+
+        // split after line feeds so that chunks usually start at a token
+        std::vector<LexedChunk> chunks;
+        unsigned long begin = 0;
+        for (unsigned long i = 1; i<=n && begin < size; i++) {
+            unsigned long end = i == n? size: std::max(begin, size / n * i);
+            if (end < size) {
+                auto nl = static_cast<const char*>(memchr(data + end, '\n', size - end));
+                end = nl? nl - data + 1: size;
+            }
+            if (end <= begin)
+                continue;
+            chunks.push_back(LexedChunk(file));
+            chunks.back().begin = begin;
+            chunks.back().end = end;
+            begin = end;
+        }
+
+        std::vector<std::thread> workers;
+        for (auto &chunk: chunks)
+            workers.push_back(std::thread([data, &chunk]() {
+                chunk.lines = countLines(data + chunk.begin, data + chunk.end);
+            }));
+        for (auto &worker: workers)
+            worker.join();
+        workers.clear();
+
+        unsigned long line = 1;
+        for (auto &chunk: chunks) {
+            chunk.start.line = line;
+            chunk.start.pos = chunk.begin;
+            line += chunk.lines;
+        }
+        for (auto &chunk: chunks)
+            workers.push_back(std::thread([data, size, &file, &chunk]() {
+                lexChunk(data, size, file, chunk);
+            }));
+        for (auto &worker: workers)
+            worker.join();
+
+        // Merge. Where the previous chunk stopped at an offset the next chunk
+        // also started a token at, the lexer states agree and the rest of that
+        // chunk is spliced in. Anywhere else the seam is repaired by lexing
+        // serially until the two line up again.
+        std::deque<token_t> tokens;
+        std::exception_ptr error;
+        auto input = std::make_shared<MemoryStream>(data, size);
+        Tokenizer repair(input, file);
+        bool repairing = false;
+        unsigned long cur = 0, k = 0;
+        PosInfo at(file);
+        while (cur < size) {
+            while (k + 1 < chunks.size() && chunks[k + 1].begin <= cur)
+                k++;
+            auto &chunk = chunks[k];
+            auto it = std::lower_bound(chunk.offsets.begin(), chunk.offsets.end(), cur);
+            if (it != chunk.offsets.end() && *it == cur) {
+                unsigned long i = it - chunk.offsets.begin();
+                const auto from = chunk.tokens[i]->pos();
+                bool same = from.line == at.line && from.col == at.col && from.pos == at.pos;
+                for (; i<chunk.tokens.size(); i++) {
+                    auto &token = chunk.tokens[i];
+                    if (same)
+                        tokens.push_back(token);
+                    else
+                        tokens.push_back(std::make_shared<Token>(token->type(), token->value(),
+                                                                 relocate(token->pos(), from, at), token->hasNewLine()));
+                }
+                at = same? chunk.endPos: relocate(chunk.endPos, from, at);
+                cur = chunk.stop;
+                repairing = false;
+                continue;
+            }
+            if (!repairing) {
+                repair.seek(cur, at, afterReturn(data, cur));
+                repairing = true;
+            }
+            try {
+                auto token = repair.next();
+                if (!token)
+                    break;
+                tokens.push_back(token);
+            } catch (ParsingException &) {
+                error = std::current_exception();
+                break;
+            }
+            at = repair.getPos();
+            cur = offsetOf(*input, size);
+        }
+        return std::make_shared<LexedTokenStream>(std::move(tokens), at, error);
+    }
+}
@@ -0,0 +1,237 @@
+#include "preprocessor.h"
+#include <fstream>
+#include <iterator>
+
+namespace cpp {
+    namespace {
+        /* the size of a seekable stream, or 0 if it cannot tell */
+        unsigned long streamSize(std::istream &input) {
+            auto p = input.tellg();
+            if (p == std::streampos(-1))
+                return 0;
+            input.seekg(0, std::ios_base::end);
+            auto e = input.tellg();
+            input.seekg(p);
+            if (e == std::streampos(-1))
+                return 0;
+            return (unsigned long) (e - p);
+        }
+    }
+
+    PipelinedTokenizer::PipelinedTokenizer(std::shared_ptr<std::istream> i, const std::string &f,
+                                           std::shared_ptr<const SourceMap> m):
+            TokenStream(), input(i), sourceMap(m), tokenizer(), queue(), chunk(), index(0),
+            done(false), stop(false), error(), endPos(f), mutex(), changed(), sleeping(0), thread() {
+        thread = std::thread(&PipelinedTokenizer::produce, this);
+    }
+
+    PipelinedTokenizer::~PipelinedTokenizer() {
+        stop.store(true, std::memory_order_release);
+        wake();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void PipelinedTokenizer::produce() {
+        // a file that fits is read here and lexed from memory, where tellg and seekg are free
+        auto size = streamSize(*input);
+        if (!dynamic_cast<MemoryBuffer*>(input->rdbuf()) && size > 0 && size <= MEMORY_LEX_MAX_SIZE)
+            input = std::make_shared<MemoryStream>(std::string((std::istreambuf_iterator<char>(*input)),
+                                                               std::istreambuf_iterator<char>()));
+        tokenizer.reset(new Tokenizer(input, endPos.file, sourceMap));
+        token_chunk_t out;
+        try {
+            while (!stop.load(std::memory_order_acquire)) {
+                // a batch is short only at the end or before an error, which comes alone
+                out.resize(PIPELINE_CHUNK_SIZE);
+                out.resize(tokenizer->nextBatch(out.data(), out.size()));
+                if (out.empty())
+                    break;
+                while (!queue.push(std::move(out))) {
+                    if (stop.load(std::memory_order_acquire))
+                        return;
+                    await([this]() { return stop.load(std::memory_order_acquire) || !queue.full(); });
+                }
+                wake();
+                out.clear();
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        endPos = tokenizer->getPos();
+        done.store(true, std::memory_order_release);
+        wake();
+    }
+
+    template <class Ready>
+    void PipelinedTokenizer::await(Ready ready) const {
+        for (int i = 0; i<PIPELINE_SPINS; i++) {
+            if (ready())
+                return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.fetch_add(1);
+        // pairs with the fence in wake(): either it sees us sleeping or we see its change
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        changed.wait(lock, ready);
+        sleeping.fetch_sub(1);
+    }
+
+    void PipelinedTokenizer::wake() const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            // taken so the sleeper is either waiting already or has yet to check
+            { std::lock_guard<std::mutex> lock(mutex); }
+            changed.notify_all();
+        }
+    }
+
+    bool PipelinedTokenizer::fill() const {
+        if (index < chunk.size())
+            return true;
+        auto self = const_cast<PipelinedTokenizer*>(this);
+        while (true) {
+            if (self->queue.pop(chunk)) {
+                wake();
+                index = 0;
+                if (!chunk.empty())
+                    return true;
+            } else if (done.load(std::memory_order_acquire)) {
+                // the producer may have pushed its last chunk right before finishing
+                if (self->queue.pop(chunk)) {
+                    index = 0;
+                    if (!chunk.empty())
+                        return true;
+                }
+                return false;
+            } else {
+                await([this]() { return !queue.empty() || done.load(std::memory_order_acquire); });
+            }
+        }
+    }
+
+    bool PipelinedTokenizer::_finished() const {
+        return !fill() && !error;
+    }
+
+    PosInfo PipelinedTokenizer::_getPos() const {
+        if (fill())
+            return chunk[index]->pos();
+        return endPos;
+    }
+
+    token_t PipelinedTokenizer::_next() {
+        if (fill())
+            return chunk[index++];
+        if (error) {
+            auto e = error;
+            error = std::exception_ptr();
+            std::rethrow_exception(e);
+        }
+        return token_t();
+    }
+
+    unsigned long PipelinedTokenizer::_nextBatch(token_t *out, unsigned long n) {
+        unsigned long count = 0;
+        while (count < n && fill()) {
+            auto m = std::min(n - count, (unsigned long) chunk.size() - index);
+            std::move(chunk.begin() + index, chunk.begin() + index + m, out + count);
+            index += m;
+            count += m;
+        }
+        // nothing left: the end, or the producer's error
+        if (count == 0 && (out[0] = _next()))
+            count++;
+        return count;
+    }
+
+    void TokenStream::rethrowBatchError() {
+        auto e = batchError;
+        batchError = std::exception_ptr();
+        std::rethrow_exception(e);
+    }
+
+    unsigned long TokenStream::nextBatch(token_t *out, unsigned long n) {
+        // tokens ungot since the error still come before it
+        unsigned long count = 0;
+        for (; count < n && !buffer.empty(); count++) {
+            out[count] = std::move(buffer.front());
+            buffer.pop_front();
+        }
+        if (batchError) {
+            if (count == 0)
+                rethrowBatchError();
+            return count;
+        }
+        if (count == n)
+            return count;
+        try {
+            return count + _nextBatch(out + count, n - count);
+        } catch (...) {
+            // hand out the tokens before the error first
+            while (count < n && out[count])
+                count++;
+            if (count == 0)
+                throw;
+            batchError = std::current_exception();
+            return count;
+        }
+    }
+
+    std::shared_ptr<TokenStream> makeTokenizer(std::shared_ptr<std::istream> input, const std::string &file, options_t options) {
+        auto size = streamSize(*input);
+        // the tokenizer seeks back over what it has read, which a pipe cannot
+        if (!size && input->tellg() == std::streampos(-1))
+            input = std::make_shared<ReplayStream>(input);
+        auto prepass = options && (options->splicePrepass || options->trigraphs);
+        // the chunks are lexed without a source map, so spliced input stays serial
+        if (options && options->lexThreads > 1 && !prepass && size >= 2 * PARALLEL_LEX_MIN_CHUNK) {
+            std::string data((std::istreambuf_iterator<char>(*input)), std::istreambuf_iterator<char>());
+            return tokenizeParallel(data.data(), data.size(), file, options->lexThreads);
+        }
+        // a thread per file pays off only with a core to run it and a file worth the handoff
+        auto pipelined = options && options->pipelined && std::thread::hardware_concurrency() > 1 &&
+                         (size == 0 || size >= PIPELINE_MIN_SIZE);
+        // lex from memory, where literals and comments are scanned in place; pipes
+        // and large files stream, and a pipelined file is read on its own thread
+        if (!dynamic_cast<MemoryBuffer*>(input->rdbuf()) &&
+                (prepass || (!pipelined && size > 0 && size <= MEMORY_LEX_MAX_SIZE)))
+            input = std::make_shared<MemoryStream>(std::string((std::istreambuf_iterator<char>(*input)),
+                                                               std::istreambuf_iterator<char>()));
+        std::shared_ptr<SourceMap> map;
+        if (prepass) {
+            auto buffer = dynamic_cast<MemoryBuffer*>(input->rdbuf());
+            std::string logical;
+            map = std::make_shared<SourceMap>();
+            if (spliceLines(buffer->current(), buffer->end() - buffer->current(), options->trigraphs, logical, *map))
+                input = std::make_shared<MemoryStream>(std::move(logical));
+        }
+        if (pipelined)
+            return std::make_shared<PipelinedTokenizer>(input, file, map);
+        return std::make_shared<Tokenizer>(input, file, map);
+    }
+
+    std::shared_ptr<TokenStream> openSource(const std::string &path, options_t options) {
+        std::shared_ptr<TokenStream> tokenizer;
+        auto prefetcher = options? options->prefetcher: std::shared_ptr<IncludePrefetcher>();
+        if (!prefetcher || !prefetcher->take(path, tokenizer)) {
+            if (options && options->files && !options->files->lookup(path).exists)
+                return tokenizer;
+            if (options && options->directives) {
+                auto text = options->directives->get(path);
+                if (!text)
+                    return tokenizer;
+                // the stream keeps the shared text alive
+                std::shared_ptr<std::istream> input(new MemoryStream(text->data(), text->size()),
+                                                    [text](std::istream *stream) { delete stream; });
+                return makeTokenizer(input, path, options);
+            }
+            auto input = std::make_shared<std::ifstream>();
+            input->open(path);
+            if (input->is_open())
+                tokenizer = makeTokenizer(input, path, options);
+        }
+        return tokenizer;
+    }
+}
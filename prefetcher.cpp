@@ -0,0 +1,153 @@
+#include "preprocessor.h"
+#include <fstream>
+#include <iterator>
+
+namespace cpp {
+    IncludePrefetcher::IncludePrefetcher(unsigned threads, std::weak_ptr<Options> o, unsigned long c):
+            mutex(), queued(), loaded(), queue(), entries(), order(), options(o), capacity(c), stopping(false), workers() {
+        if (threads < 1)
+            threads = 1;
+        for (unsigned i = 0; i<threads; i++)
+            workers.push_back(std::thread(&IncludePrefetcher::work, this));
+    }
+
+    IncludePrefetcher::~IncludePrefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        for (auto &worker: workers)
+            worker.join();
+    }
+
+    void IncludePrefetcher::prefetch(const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (entries.count(path) || (entries.size() >= capacity && !evict()))
+                return;
+            entries[path] = std::make_shared<Entry>();
+            order.push_back(path);
+            queue.push_back(path);
+        }
+        queued.notify_one();
+    }
+
+    bool IncludePrefetcher::evict() {
+        for (auto it = order.begin(); it != order.end(); ++it) {
+            auto entry = entries.find(*it);
+            if (entry->second->ready) {
+                entries.erase(entry);
+                order.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    namespace {
+        inline const char *skipBlank(const char *p, const char *e) {
+            while (p < e && (*p == ' ' || *p == '\t'))
+                p++;
+            return p;
+        }
+    }
+
+    void IncludePrefetcher::scan(const std::string &file, const char *data, unsigned long size) {
+        const char *p = data, *e = data + size;
+        while (p < e) {
+            auto eol = static_cast<const char*>(memchr(p, '\n', e - p));
+            if (!eol)
+                eol = e;
+            p = skipBlank(p, eol);
+            if (p < eol && *p == '#') {
+                p = skipBlank(p + 1, eol);
+                if (eol - p > 7 && memcmp(p, "include", 7) == 0) {
+                    p = skipBlank(p + 7, eol);
+                    if (p < eol && *p == '"') {
+                        auto q = static_cast<const char*>(memchr(p + 1, '"', eol - p - 1));
+                        if (q && q > p + 1) {
+                            std::string result;
+                            resolve(file, std::string(p + 1, q), result);
+                            prefetch(result);
+                        }
+                    }
+                }
+            }
+            p = eol + 1;
+        }
+    }
+
+    void IncludePrefetcher::work() {
+        while (true) {
+            std::string path;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (stopping)
+                    return;
+                path = queue.front();
+                queue.pop_front();
+            }
+            load(path);
+        }
+    }
+
+    void IncludePrefetcher::load(const std::string &path) {
+        auto options = this->options.lock();
+        std::shared_ptr<const std::string> text;
+        if (options && options->directives) {
+            text = options->directives->get(path);
+        } else {
+            std::ifstream input(path, std::ios_base::in | std::ios_base::binary);
+            if (input.is_open())
+                text = std::make_shared<std::string>((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+        }
+        std::shared_ptr<std::vector<token_t>> tokens;
+        PosInfo endPos("");
+        std::exception_ptr error;
+        if (text) {
+            scan(path, text->data(), text->size());
+
+            // the stream keeps the text alive
+            std::shared_ptr<std::istream> input(new MemoryStream(text->data(), text->size()),
+                                                [text](std::istream *stream) { delete stream; });
+            auto tokenizer = makeTokenizer(input, path, options);
+            token_t batch[TOKEN_BATCH_SIZE];
+            tokens = std::make_shared<std::vector<token_t>>();
+            try {
+                while (auto count = tokenizer->nextBatch(batch, TOKEN_BATCH_SIZE))
+                    std::move(batch, batch + count, std::back_inserter(*tokens));
+            } catch (ParsingException &) {
+                error = std::current_exception();
+            }
+            endPos = tokenizer->getPos();
+        }
+        {
+            // only loaded entries are evicted, so this one is still there
+            std::lock_guard<std::mutex> lock(mutex);
+            auto &entry = entries[path];
+            entry->opened = (bool) text;
+            entry->tokens = tokens;
+            entry->endPos = endPos;
+            entry->error = error;
+            entry->ready = true;
+        }
+        loaded.notify_all();
+    }
+
+    bool IncludePrefetcher::take(const std::string &path, std::shared_ptr<TokenStream> &stream) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = entries.find(path);
+        if (it == entries.end())
+            return false;
+        // held here, the entry outlives an eviction while we wait
+        auto entry = it->second;
+        loaded.wait(lock, [&entry]() { return entry->ready; });
+        if (entry->opened)
+            stream = std::make_shared<LexedTokenStream>(entry->tokens, entry->endPos, entry->error);
+        else
+            stream.reset();
+        return true;
+    }
+}
@@ -2,10 +2,12 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "preprocessor.h"
 
-cpp::PosInfo cpp::posStart("");
-
 inline void assert(bool cond) {
     if (!cond)
         throw cpp::ParsingException("Assertion failed", cpp::posStart);
@@ -68,13 +70,13 @@ void testMacroExpansion() {
     using namespace cpp;
     auto ss = std::make_shared<std::stringstream>();
     ss->str("foo");
-    macro_table_t table = std::make_shared<std::map<std::string, std::shared_ptr<Macro>>>();
+    macro_table_t table = std::make_shared<MacroTable>();
     auto macro = std::make_shared<Macro>("foo");
     PosInfo pi("anon");
     std::deque<token_t> body;
     body.push_back(std::make_shared<Token>(Token::NUMBER, "2", pi));
     macro->setBody(body);
-    (*table)["foo"] = macro;
+    table->define(macro);
     auto tokenizer = std::make_shared<Tokenizer>(ss, "anon");
     auto expander = std::make_shared<MacroExpander>(tokenizer, table, std::shared_ptr<MacroStack>());
     auto token = expander->next();
@@ -82,35 +84,1126 @@ void testMacroExpansion() {
     std::cout << token->value() << std::endl;
 }
 
-void processFile(std::shared_ptr<std::istream> input, const std::string &file) {
+void testPipelinedTokenizer() {
     using namespace cpp;
-    auto macroTable = std::make_shared<std::map<std::string, std::shared_ptr<Macro>>>();
-    auto stack = std::shared_ptr<MacroStack>();
-    auto tokenizer = std::make_shared<Tokenizer>(input, file);
-    auto dirParser = std::make_shared<DirectiveParser>(tokenizer, macroTable, stack, file, 0);
-    auto expander = std::make_shared<MacroExpander>(dirParser, macroTable, stack);
+    std::stringstream source;
+    for (int i = 0; i<2000; i++)
+        source << "int x" << i << " = " << i << "; /* " << i << " */\n";
+    auto serialInput = std::make_shared<std::stringstream>(source.str());
+    auto pipelinedInput = std::make_shared<std::stringstream>(source.str());
+    Tokenizer serial(serialInput, "file");
+    PipelinedTokenizer pipelined(pipelinedInput, "file");
+    while (auto token = serial.next()) {
+        assert(!pipelined.finished());
+        auto other = pipelined.next();
+        assert(other->type() == token->type());
+        assert(other->value() == token->value());
+        assert(other->pos().line == token->pos().line);
+    }
+    assert(!pipelined.next());
+    assert(pipelined.finished());
+    // a pipe cannot seek back, which the tokenizer does
+    class Unseekable: public std::streambuf {
+    public:
+        Unseekable(std::string &s) {
+            setg(&s[0], &s[0], &s[0] + s.size());
+        }
+    };
+    std::string texts[2] = {source.str(), "a /* unterminated"};
+    Unseekable pipe(texts[0]), unclosed(texts[1]);
+    auto piped = makeTokenizer(std::make_shared<std::istream>(&pipe), "file", options_t());
+    serialInput->clear();
+    serialInput->seekg(0);
+    Tokenizer again(serialInput, "file");
+    while (auto token = again.next())
+        assert(piped->next()->value() == token->value());
+    assert(!piped->next());
+    piped = makeTokenizer(std::make_shared<std::istream>(&unclosed), "file", options_t());
+    assert(piped->next()->value() == "a");
     try {
-        expander->print(std::cout);
-        std::cout << std::endl;
+        piped->next();
+        assert(false);
     } catch (ParsingException &e) {
+        assert(e.message() == "Unterminated comment");
+    }
+
+    // more chunks than the queue holds: the producer is asleep when this one goes
+    {
+        PipelinedTokenizer abandoned(std::make_shared<std::stringstream>(source.str()), "file");
+        assert(abandoned.next() != nullptr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+void testParallelTokenizer() {
+    using namespace cpp;
+    // seams land inside comments, strings, raw strings and line splices
+    std::string source;
+    for (int i = 0; i<200; i++) {
+        source += "int a" + std::to_string(i) + " = 0x" + std::to_string(i) + "; /* block\n";
+        source += " comment */ const char *s = \"str\\\"ing\";\r\n";
+        source += "auto r = R\"d(raw\n\"line\")d\"; x = y \\\n+ 1; // line\n";
+    }
+    auto input = std::make_shared<std::stringstream>(source);
+    Tokenizer serial(input, "file");
+    for (unsigned long chunk = 7; chunk<200; chunk += 31) {
+        auto parallel = tokenizeParallel(source.data(), source.size(), "file", 8, chunk);
+        input->clear();
+        input->str(source);
+        serial.seek(0, PosInfo("file"), false);
+        while (auto token = serial.next()) {
+            auto other = parallel->next();
+            assert(other->type() == token->type());
+            assert(other->value() == token->value());
+            assert(other->hasNewLine() == token->hasNewLine());
+            assert(other->pos().line == token->pos().line);
+            assert(other->pos().col == token->pos().col);
+            assert(other->pos().pos == token->pos().pos);
+        }
+        assert(!parallel->next());
+    }
+}
+
+void testPreprocessor() {
+    using namespace cpp;
+    class Recorder: public PreprocessorCallbacks, public TokenSink {
+    public:
+        std::string text, events;
+
+        virtual void macroDefined(const Macro &macro, const PosInfo &/* pos */) {
+            events += "+" + macro.name();
+        }
+        virtual void macroUndefined(const std::string &name, const PosInfo &/* pos */) {
+            events += "-" + name;
+        }
+        virtual void macroExpanded(const Macro &macro, const PosInfo &/* pos */) {
+            events += "!" + macro.name();
+        }
+        virtual void tokens(const TokenRecord *records, unsigned long count) {
+            for (unsigned long i = 0; i<count; i++) {
+                if (records[i].leadingSpace)
+                    text.push_back(' ');
+                text.append(records[i].spelling, records[i].size);
+            }
+        }
+    };
+    auto recorder = std::make_shared<Recorder>();
+    Preprocessor preprocessor;
+    preprocessor.setCallbacks(recorder);
+    preprocessor.define("A", "B + 1");
+    preprocessor.define("B");
+    preprocessor.undef("B");
+    preprocessor.setInput(std::make_shared<std::stringstream>("#define F(x) x A\nF(2)"), "anon");
+    assert(preprocessor.run(*recorder));
+    assert(recorder->text == "\n2 B + 1");
+    assert(recorder->events == "+A+B-B+F!F!A");
+}
+
+void testBinaryStream() {
+    using namespace cpp;
+    std::stringstream out;
+    BinaryTokenWriter writer(out, true);
+    Preprocessor preprocessor;
+    preprocessor.setInput(std::make_shared<std::stringstream>("#define X a\nint X  =\n  X;"), "anon");
+    assert(preprocessor.run(writer));
+    writer.finish();
+
+    auto data = out.str();
+    BinaryTokenReader reader(data.data(), data.size());
+    assert(reader.hasLocations());
+    assert(reader.recordCount() == 5);
+    const char *expected[] = {"int", "a", "=", "a", ";"};
+    int lines[] = {2, 1, 2, 1, 3};
+    BinaryToken token;
+    for (int i = 0; i<5; i++) {
+        assert(reader.next(token));
+        assert(std::string(token.spelling, token.size) == expected[i]);
+        assert(std::string(token.file, token.fileSize) == "anon");
+        assert(token.line == lines[i]);
+    }
+    assert(!reader.next(token));
+    reader.rewind();
+    assert(reader.next(token) && token.newLine && token.kind == Token::IDENTIFIER);
+    assert(reader.next(token) && token.leadingSpace && !token.newLine);
+
+    // a string offset past the string data is refused
+    data.replace(BINARY_HEADER_SIZE + 4, 4, 4, '\xff');
+    bool refused = false;
+    try {
+        BinaryTokenReader corrupt(data.data(), data.size());
+    } catch (ParsingException &) {
+        refused = true;
+    }
+    assert(refused);
+}
+
+void testMemoryBudget() {
+    using namespace cpp;
+    std::string source("#define BIG");
+    for (int i = 0; i<1000; i++)
+        source += " x" + std::to_string(i);
+    source += "\nBIG\n#undef BIG\n";
+
+    auto options = std::make_shared<Options>();
+    options->memory = std::make_shared<MemoryBudget>();
+    std::stringstream out;
+    TextSink sink(out);
+    {
+        Preprocessor preprocessor(options);
+        preprocessor.setInput(std::make_shared<std::stringstream>(source), "anon");
+        assert(preprocessor.run(sink));
+        assert(options->memory->peak() > 1000 * sizeof(Token));
+        assert(options->memory->current() == 0);
+    }
+
+    options->memory = std::make_shared<MemoryBudget>(1000 * sizeof(Token));
+    Preprocessor preprocessor(options);
+    preprocessor.setInput(std::make_shared<std::stringstream>(source), "anon");
+    bool thrown = false;
+    try {
+        preprocessor.run(sink);
+    } catch (ParsingException &e) {
+        thrown = std::string(e.what()).find("Memory budget") != std::string::npos;
+    }
+    assert(thrown);
+}
+
+void testFileSystemCache() {
+    using namespace cpp;
+    std::string path("/tmp/cpp-fs-cache-test.h");
+    std::remove(path.c_str());
+    FileSystemCache cache;
+    assert(!cache.lookup(path).exists);
+    assert(!cache.lookup(path).exists);
+    assert(cache.stats().negativeHits == 1);
+
+    std::ofstream(path) << "int x;\n";
+    assert(!cache.lookup(path).exists);
+    assert(cache.revalidate() == 1);
+    auto info = cache.lookup(path);
+    assert(info.exists && info.size == 7 && info.canonical.empty() && cache.canonical(path) == path);
+    assert(cache.lookup(path).inode == info.inode);
+    std::remove(path.c_str());
+    assert(cache.lookup(path).exists);
+    cache.invalidate();
+    assert(!cache.lookup(path).exists);
+    assert(cache.stats().lookups == 8 && cache.stats().hits == 5);
+    assert(cache.stats().syscallsSaved == (long) cache.stats().negativeHits - 3);
+}
+
+void testMacroTableFork() {
+    using namespace cpp;
+    auto base = std::make_shared<MacroTable>();
+    base->define(std::make_shared<Macro>("A"));
+    base->define(std::make_shared<Macro>("B"));
+    auto fork1 = base->fork(), fork2 = base->fork();
+    fork1->undef("A");
+    fork1->define(std::make_shared<Macro>("C"));
+    fork2->define(std::make_shared<Macro>("A", true));
+    base->define(std::make_shared<Macro>("D"));
+    assert(!fork1->find("A") && fork1->find("B") != nullptr && fork1->find("C") != nullptr && !fork1->find("D"));
+    assert(fork2->find("A")->isFunctionLike() && !fork2->find("C"));
+    assert(!base->find("A")->isFunctionLike() && !base->find("C") && base->find("D") != nullptr);
+    assert(fork1->visible().size() == 2 && base->visible().size() == 3);
+    fork1->define(std::make_shared<Macro>("A"));
+    assert(fork1->find("A") != nullptr);
+
+    // a long chain of forks is squashed instead of searched
+    auto table = base;
+    for (int i = 0; i<3 * MACRO_LAYER_MAX_DEPTH; i++) {
+        table->define(std::make_shared<Macro>("M" + std::to_string(i)));
+        table->undef("B");
+        table = table->fork();
+    }
+    assert(table->visible().size() == 3 * MACRO_LAYER_MAX_DEPTH + 2 && !table->find("B"));
+}
+
+void testSpliceLines() {
+    using namespace cpp;
+    std::string source("a ?\?= b\\\nc R\"(x\\\ny)\"\r\n?\?(d"), logical;
+    SourceMap map;
+    assert(!spliceLines("a\\b ?\?=", 7, false, logical, map) && logical.empty());
+    assert(spliceLines(source.data(), source.size(), true, logical, map));
+    assert(logical == "a # bc R\"(xy)\"\r\n[d" && map.edits.size() == 4);
+
+    // locations are reported where the bytes were written
+    auto tokenizer = std::make_shared<Tokenizer>(std::make_shared<MemoryStream>(logical.data(), logical.size()),
+                                                 "file", std::make_shared<SourceMap>(map));
+    std::vector<token_t> tokens;
+    while (auto token = tokenizer->next())
+        tokens.push_back(token);
+    assert(tokens[2]->value() == "#" && tokens[2]->pos().col == 2);
+    assert(tokens[4]->value() == "bc" && tokens[4]->pos().line == 1 && tokens[4]->pos().col == 6);
+    assert(tokens[6]->value() == "R\"(x\\\ny)\"" && tokens[6]->pos().line == 2 && tokens[6]->pos().col == 2);
+    assert(tokens[8]->value() == "[" && tokens[8]->pos().line == 4 && tokens[8]->pos().col == 0);
+    assert(tokens[9]->value() == "d" && tokens[9]->pos().col == 3 && tokens[9]->pos().pos == source.size() - 1);
+
+    // the prepass lexes like the serial tokenizer, up to where an error is reported
+    auto prepass = std::make_shared<Options>();
+    prepass->splicePrepass = true;
+    for (auto text: {"\\\na\\\n\\\r\n b\\", ")\"//\tL>", "x \\\n = \"a\\\nb"}) {
+        std::string lexed[2];
+        options_t options[2] = {options_t(), prepass};
+        for (int i = 0; i<2; i++) {
+            auto stream = makeTokenizer(std::make_shared<std::stringstream>(text), "file", options[i]);
+            try {
+                while (auto token = stream->next())
+                    lexed[i] += token->value() + "@" + std::to_string(token->pos().col) + " ";
+            } catch (ParsingException &e) {
+                lexed[i] += e.message() + "@" + std::to_string(e.position().col);
+            }
+        }
+        assert(lexed[0] == lexed[1]);
+    }
+}
+
+void testIncludeTracer() {
+    using namespace cpp;
+    NullSink sink;
+    std::string path("/tmp/cpp-trace-test.h");
+    std::ofstream(path) << "#define A 1\nint a = A;\n";
+    auto tracer = std::make_shared<IncludeTracer>();
+    for (int i = 0; i<2; i++) {
+        Preprocessor preprocessor;
+        preprocessor.setCallbacks(tracer);
+        preprocessor.setInput(std::make_shared<std::stringstream>("#include \"" + path + "\"\nA"), "anon");
+        tracer->beginFile("anon");
+        assert(preprocessor.run(sink));
+        tracer->endFile();
+    }
+    std::remove(path.c_str());
+
+    std::stringstream trace, summary;
+    tracer->writeTrace(trace);
+    tracer->writeSummary(summary);
+    assert(trace.str().find("\"name\": \"" + path + "\", \"cat\": \"include\"") != std::string::npos);
+    assert(trace.str().find("\"bytes\": 23, \"tokens\": 10, \"macros\": 1, \"expansions\": 1") != std::string::npos);
+    assert(summary.str().find("self ms") != std::string::npos);
+    assert(summary.str().find("      2         46         20        2          2  " + path) != std::string::npos);
+}
+
+void testCompactSink() {
+    using namespace cpp;
+    std::stringstream out;
+    CompactSink sink(out, true);
+    Preprocessor preprocessor;
+    preprocessor.setInput(std::make_shared<std::stringstream>(
+            "#define P +\n#define N 1\na + P+ b - -1 .5 N .. N.\n\n\nx/ /y L \"s\" \"s\" z / *p"), "anon");
+    assert(preprocessor.run(sink));
+    sink.finish();
+    assert(out.str() == "# 3 \"anon\"\na+ + +b- -1 .5 1 . . 1 .\n# 6 \"anon\"\nx/ /y L \"s\"\"s\" z/ *p\n");
+
+    // an #include left alone ends its own line
+    out.str("");
+    preprocessor.setInput(std::make_shared<std::stringstream>("#include <none.h>\na\n\n\nb"), "anon");
+    assert(preprocessor.run(sink));
+    sink.finish();
+    assert(out.str() == "# 1 \"anon\"\n#include <none.h>\na\n# 5 \"anon\"\nb\n");
+}
+
+void testManifestCache() {
+    using namespace cpp;
+    assert(sha256("abc", 3) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    std::string million(1000000, 'a');
+    HashingStream hashed(nullptr);
+    for (int i = 0; i<1000; i++)
+        hashed.write(million.data(), 1000);
+    assert(hashed.finish() == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+    std::string dir("/tmp/cpp-manifest-test"), input(dir + "/in.c"), header(dir + "/in.h");
+    ManifestCache cache(dir);
+    std::ofstream(input) << "#include \"in.h\"\n";
+    std::ofstream(header) << "int x;\n";
+    auto key = cache.key(input, "-DX\n");
+    assert(key.size() == 64 && key != cache.key(input, "-DY\n"));
+    assert(cache.store(key, std::vector<std::string>{header}, "int x;\n", sha256("int x;\n", 7)));
+    std::string output;
+    assert(cache.load(cache.lookup(key), output) && output == "int x;\n");
+    std::ofstream(header) << "int y;\n";
+    assert(cache.lookup(key).empty());
+    std::remove(input.c_str());
+    assert(cache.key(input, "-DX\n").empty());
+    std::remove(header.c_str());
+}
+
+void testIncludeNext() {
+    using namespace cpp;
+    std::string dir("/tmp/cpp-include-next-test");
+    for (auto sub: {"", "/a", "/b"})
+        mkdir((dir + sub).c_str(), 0777);
+    std::ofstream(dir + "/a/w.h") << "#include_next <w.h>\nint a;\n";
+    std::ofstream(dir + "/b/w.h") << "int b;\n";
+    Preprocessor preprocessor;
+    preprocessor.addIncludePath(dir + "/a");
+    preprocessor.addIncludePath(dir + "/b");
+    preprocessor.setInput(std::make_shared<std::stringstream>("#include <w.h>\n"), "m.c");
+    std::stringstream out;
+    TextSink sink(out);
+    assert(preprocessor.run(sink));
+    auto text = out.str();
+    assert(text.find("int b;") < text.find("int a;") && text.find("int a;") != std::string::npos);
+}
+
+void testIncludePrefetcher() {
+    using namespace cpp;
+    std::string dir("/tmp/cpp-prefetch-test");
+    mkdir(dir.c_str(), 0777);
+    std::ofstream(dir + "/m.c") << "#include \"s.h\"\n#include \"s.h\"\nint m;\n";
+    std::ofstream(dir + "/s.h") << "int s;\n";
+    std::ofstream(dir + "/t.h") << "int t;\n";
+    IncludePrefetcher prefetcher(2, std::weak_ptr<Options>(), 2);
+    prefetcher.prefetch(dir + "/m.c");
+    std::shared_ptr<TokenStream> stream;
+    assert(prefetcher.take(dir + "/m.c", stream) && stream);
+    // a header taken once is still held for its next include
+    assert(prefetcher.take(dir + "/s.h", stream) && stream->next()->value() == "int");
+    assert(prefetcher.take(dir + "/s.h", stream) && stream->next()->value() == "int");
+    // full, so the oldest loaded file makes room
+    prefetcher.prefetch(dir + "/t.h");
+    assert(prefetcher.take(dir + "/t.h", stream) && stream);
+    assert(!prefetcher.take(dir + "/m.c", stream));
+    assert(!prefetcher.take(dir + "/missing.h", stream));
+}
+
+void testMacroIndex() {
+    using namespace cpp;
+    NullSink sink;
+    MacroIndexWriter writer;
+    for (auto unit: {"a.c", "b.c"}) {
+        auto recorder = std::make_shared<MacroUseRecorder>();
+        Preprocessor preprocessor;
+        preprocessor.setCallbacks(recorder);
+        preprocessor.setInput(std::make_shared<std::stringstream>(
+                std::string("#define M 1\n#define ") + unit[0] + " M\n" + unit[0] + "\n#undef M"), unit);
+        assert(preprocessor.run(sink));
+        writer.update(unit, std::move(recorder->uses));
+    }
+    std::stringstream first;
+    writer.write(first);
+    auto data = first.str();
+    MacroIndexReader reader(data.data(), data.size());
+    unsigned long begin, count;
+    assert(reader.nameCount() == 3 && !reader.find("N", begin, count));
+    assert(reader.find("M", begin, count) && count == 6);
+    MacroIndexEntry entry;
+    // M is expanded inside the body of a, so the use is reported there
+    reader.entry(begin + 1, entry);
+    assert(entry.kind == MacroUse::EXPAND && entry.line == 2 && std::string(entry.unit, entry.unitSize) == "a.c");
+    reader.entry(begin + 5, entry);
+    assert(entry.kind == MacroUse::UNDEF && std::string(entry.unit, entry.unitSize) == "b.c");
+
+    // updating one unit keeps the others
+    MacroIndexWriter next;
+    next.load(reader);
+    next.update("a.c", std::vector<MacroUse>());
+    std::stringstream second;
+    next.write(second);
+    data = second.str();
+    MacroIndexReader updated(data.data(), data.size());
+    assert(updated.nameCount() == 2 && !updated.find("a", begin, count) && updated.find("b", begin, count));
+    assert(updated.find("M", begin, count) && count == 3);
+
+    // a string offset past the string data is refused
+    data.replace(INDEX_HEADER_SIZE + updated.nameCount() * INDEX_NAME_SIZE + 4, 4, 4, '\xff');
+    bool refused = false;
+    try {
+        MacroIndexReader corrupt(data.data(), data.size());
+    } catch (ParsingException &) {
+        refused = true;
+    }
+    assert(refused);
+
+    // expansions nested in a cached one are reported each time
+    auto recorder = std::make_shared<MacroUseRecorder>();
+    Preprocessor preprocessor;
+    preprocessor.setCallbacks(recorder);
+    preprocessor.setInput(std::make_shared<std::stringstream>("#define B 1\n#define A B\nA A A"), "c.c");
+    assert(preprocessor.run(sink));
+    assert(std::count_if(recorder->uses.begin(), recorder->uses.end(), [](const MacroUse &use) {
+        return use.kind == MacroUse::EXPAND && use.name == "B";
+    }) == 3);
+}
+
+void testMacrosOnly() {
+    using namespace cpp;
+    Preprocessor preprocessor;
+    preprocessor.define("D", "x  +  y");
+    preprocessor.setInput(std::make_shared<std::stringstream>(
+            "#define F(a, ...) a ## __VA_ARGS__ /* c */ #a\n"
+            "int s = F(1, 2); const char *t = \"\\\"\\n#define BAD1\";\n"
+            "auto r = u8R\"x(\n#define BAD2\n)x\"; /* \n#define BAD3 */ int\\\n#define BAD4\n"
+            "#if defined F && 'a' == 97\n#define E\n#endif\n#undef D\n"), "");
+    assert(preprocessor.runDirectives());
+    std::stringstream ss;
+    writeDefines(ss, *preprocessor.macroTable());
+    assert(ss.str() == "#define E\n#define F(a,...) a ## __VA_ARGS__ #a\n");
+}
+
+void testMinimizeDirectives() {
+    using namespace cpp;
+    std::string source =
+            "int a; /* x\n#define NO1 */ char *s = \"\\\"\\n#define NO2\";\n"
+            "  # define A /* y\n */ 1 \\\r\n 2 // z\n"
+            "auto r = R\"q(\n#define NO3\n)q\"; x \\\n#define NO4\n"
+            "/*\n*/ #include \"a//b.h\" \n#endif";
+    std::string out;
+    minimizeDirectives(source.data(), source.size(), out);
+    assert(out == "\n\n  # define A /* y\n */ 1 \\\r\n 2 // z\n\n\n\n\n\n   #include \"a//b.h\" \n#endif");
+}
+
+void testTokenBatches() {
+    using namespace cpp;
+    std::string source("#define F(x) x + x\n#define N 1\n");
+    for (int i = 0; i<300; i++)
+        source += "int a" + std::to_string(i) + " = F(N);\n";
+    source += "char *s = \"s";
+    auto expand = [&source]() {
+        auto options = std::make_shared<Options>();
+        auto table = std::make_shared<MacroTable>();
+        auto tokenizer = std::make_shared<Tokenizer>(std::make_shared<std::stringstream>(source), "file");
+        auto parser = std::make_shared<DirectiveParser>(tokenizer, table, std::shared_ptr<MacroStack>(), "file", 0, options);
+        return std::make_shared<MacroExpander>(parser, table, std::shared_ptr<MacroStack>(), options);
+    };
+    std::vector<std::string> expected;
+    try {
+        auto serial = expand();
+        while (auto token = serial->next())
+            expected.push_back(token->value());
+        assert(false);
+    } catch (ParsingException &) {}
+
+    // batches mixed with next() give the same tokens, then the error
+    auto batched = expand();
+    std::vector<std::string> actual;
+    token_t batch[TOKEN_BATCH_SIZE];
+    bool thrown = false;
+    try {
+        for (int round = 0; ; round++) {
+            if (round < 20 && round % 2 == 0) {
+                actual.push_back(batched->next()->value());
+                continue;
+            }
+            auto count = batched->nextBatch(batch, round < 20? 7: TOKEN_BATCH_SIZE);
+            assert(count > 0);
+            for (unsigned long i = 0; i<count; i++) {
+                actual.push_back(batch[i]->value());
+                batch[i].reset();
+            }
+        }
+    } catch (ParsingException &) {
+        thrown = true;
+    }
+    assert(thrown && actual == expected);
+
+    // after a short batch next() throws the error too
+    Tokenizer tokenizer(std::make_shared<std::stringstream>("a b \"x"), "file");
+    auto count = tokenizer.nextBatch(batch, TOKEN_BATCH_SIZE);
+    assert(count > 0 && count < TOKEN_BATCH_SIZE);
+    for (unsigned long i = 0; i<count; i++)
+        batch[i].reset();
+    thrown = false;
+    try {
+        tokenizer.next();
+    } catch (ParsingException &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    PipelinedTokenizer pipelined(std::make_shared<std::stringstream>(source), "file");
+    unsigned long lexed = 0;
+    thrown = false;
+    try {
+        while (auto count = pipelined.nextBatch(batch, TOKEN_BATCH_SIZE)) {
+            for (unsigned long i = 0; i<count; i++)
+                batch[i].reset();
+            lexed += count;
+        }
+    } catch (ParsingException &) {
+        thrown = true;
+    }
+    assert(thrown && lexed > 300 * 10);
+}
+
+bool processFile(cpp::Preprocessor &preprocessor, cpp::TokenSink &sink, std::ostream *text, bool &clean) {
+    clean = true;
+    try {
+        if (!preprocessor.run(sink))
+            return false;
+        if (text)
+            *text << std::endl;
+    } catch (cpp::ParsingException &e) {
         std::cerr << e.what() << std::endl;
+        clean = false;
+    }
+    return true;
+}
+
+/* processes a file with sinks of its own writing to os */
+bool processFile(cpp::Preprocessor &preprocessor, std::ostream &os, bool compact, bool markers, bool &clean) {
+    cpp::TextSink text(os);
+    cpp::CompactSink compactSink(os, markers);
+    if (!compact)
+        return processFile(preprocessor, text, &os, clean);
+    bool opened = processFile(preprocessor, compactSink, nullptr, clean);
+    compactSink.finish();
+    return opened;
+}
+
+/*
+ * Takes an exclusive lock on a file made for the purpose at path, or
+ * returns -1. A run that locked the file just before its holder removed
+ * it tries again, so two runs never hold locks on different files.
+ */
+int lockFile(const std::string &path) {
+    while (true) {
+        auto fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd < 0 || flock(fd, LOCK_EX) != 0)
+            return fd;
+        struct stat held, current;
+        if (fstat(fd, &held) == 0 && stat(path.c_str(), &current) == 0 &&
+                held.st_dev == current.st_dev && held.st_ino == current.st_ino)
+            return fd;
+        close(fd);
     }
 }
 
+/* removes the file taken by lockFile while still holding it */
+void unlockFile(const std::string &path, int fd) {
+    if (fd < 0)
+        return;
+    unlink(path.c_str());
+    close(fd);
+}
+
+/* prints every use of a macro recorded in an index */
+int lookupMacro(const std::string &path, const std::string &name) {
+    cpp::MappedFile file(path);
+    if (!file.isOpen()) {
+        std::cerr << "Open file failed: " << path << std::endl;
+        return 1;
+    }
+    static const char *kinds[] = {"define", "undef", "expand"};
+    try {
+        cpp::MacroIndexReader reader(file.data(), file.size());
+        unsigned long first, count;
+        if (!reader.find(name, first, count))
+            return 1;
+        for (auto i = first; i<first + count; i++) {
+            cpp::MacroIndexEntry entry;
+            reader.entry(i, entry);
+            std::cout << kinds[entry.kind] << ' ';
+            std::cout.write(entry.file, entry.fileSize);
+            std::cout << ':' << entry.line << ':' << entry.col << " in ";
+            std::cout.write(entry.unit, entry.unitSize);
+            std::cout << '\n';
+        }
+    } catch (cpp::ParsingException &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/* preprocesses files on several threads, recording what each does with macros into writer */
+void indexFiles(cpp::Preprocessor &base, cpp::options_t options, const std::vector<std::string> &files,
+                cpp::MacroIndexWriter &writer) {
+    // forked up front, since forking changes the base
+    std::vector<std::shared_ptr<cpp::Preprocessor>> units;
+    std::vector<std::shared_ptr<cpp::MacroUseRecorder>> recorders;
+    for (const auto &file: files) {
+        auto unitOptions = std::make_shared<cpp::Options>(*options);
+        recorders.push_back(std::make_shared<cpp::MacroUseRecorder>());
+        unitOptions->callbacks = recorders.back();
+        units.push_back(base.fork(unitOptions));
+        units.back()->setInput(file);
+    }
+
+    std::atomic<unsigned long> next(0);
+    std::mutex errors;
+    auto work = [&]() {
+        cpp::NullSink sink;
+        for (unsigned long i; (i = next++) < files.size();) {
+            bool opened = true;
+            try {
+                opened = units[i]->run(sink);
+            } catch (cpp::ParsingException &e) {
+                std::lock_guard<std::mutex> lock(errors);
+                std::cerr << e.what() << std::endl;
+            }
+            if (!opened) {
+                std::lock_guard<std::mutex> lock(errors);
+                std::cerr << "Open file failed: " << files[i] << std::endl;
+            }
+            writer.update(files[i], std::move(recorders[i]->uses));
+        }
+    };
+    // a memory budget is not shared between threads
+    unsigned long threads = options->memory? 1: std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (unsigned long i = 1; i<std::min(threads, (unsigned long) files.size()); i++)
+        workers.push_back(std::thread(work));
+    work();
+    for (auto &worker: workers)
+        worker.join();
+}
+
+/*
+ * Finds what each file includes from its directives alone, on several
+ * threads sharing one DirectiveCache. A file that cannot be scanned
+ * gets no entry in includes and makes this return false.
+ */
+bool scanFiles(cpp::Preprocessor &base, cpp::options_t options, const std::vector<std::string> &files,
+               std::vector<std::shared_ptr<cpp::IncludeRecorder>> &includes) {
+    options = std::make_shared<cpp::Options>(*options);
+    options->directives = std::make_shared<cpp::DirectiveCache>();
+    options->prefetcher.reset();
+    std::vector<std::shared_ptr<cpp::Preprocessor>> units;
+    includes.clear();
+    for (const auto &file: files) {
+        auto unitOptions = std::make_shared<cpp::Options>(*options);
+        includes.push_back(std::make_shared<cpp::IncludeRecorder>());
+        unitOptions->callbacks = includes.back();
+        units.push_back(base.fork(unitOptions));
+        units.back()->setInput(file);
+    }
+
+    std::atomic<unsigned long> next(0);
+    std::atomic<bool> ok(true);
+    std::mutex errors;
+    auto work = [&]() {
+        for (unsigned long i; (i = next++) < files.size();) {
+            bool opened = true;
+            try {
+                opened = units[i]->runDirectives();
+            } catch (cpp::ParsingException &e) {
+                std::lock_guard<std::mutex> lock(errors);
+                std::cerr << e.what() << std::endl;
+                includes[i].reset();
+                ok = false;
+                continue;
+            }
+            if (!opened) {
+                std::lock_guard<std::mutex> lock(errors);
+                std::cerr << "Open file failed: " << files[i] << std::endl;
+                includes[i].reset();
+                ok = false;
+            }
+        }
+    };
+    unsigned long threads = options->memory? 1: std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (unsigned long i = 1; i<std::min(threads, (unsigned long) files.size()); i++)
+        workers.push_back(std::thread(work));
+    work();
+    for (auto &worker: workers)
+        worker.join();
+    return ok;
+}
+
+/* writes a path into a make rule */
+void writeMakePath(std::ostream &os, const std::string &path) {
+    for (auto c: path) {
+        if (c == ' ' || c == '#')
+            os.put('\\');
+        else if (c == '$')
+            os.put('$');
+        os.put(c);
+    }
+}
+
+/* a make rule for the object built from file, depending on it and what it includes */
+void writeMakeRule(std::ostream &os, const std::string &file, const std::vector<std::string> &includes) {
+    auto slash = file.rfind('/');
+    auto name = slash == std::string::npos? file: file.substr(slash + 1);
+    auto dot = name.rfind('.');
+    writeMakePath(os, (dot == std::string::npos? name: name.substr(0, dot)) + ".o");
+    os << ": ";
+    writeMakePath(os, file);
+    for (const auto &include: includes) {
+        os << " \\\n  ";
+        writeMakePath(os, include);
+    }
+    os << '\n';
+}
+
+void writeJsonString(std::ostream &os, const std::string &s) {
+    os << '"';
+    for (auto c: s) {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if ((unsigned char) c < 0x20)
+            os << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xf];
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+/* a byte count with an optional K, M or G suffix */
+unsigned long parseSize(const std::string &s) {
+    std::size_t end = 0;
+    unsigned long n = std::stoul(s, &end);
+    if (end < s.size()) {
+        static const char units[] = "kmg";
+        auto unit = strchr(units, tolower(s[end]));
+        if (unit && *unit)
+            n <<= 10 * (unit - units + 1);
+    }
+    return n;
+}
+
 int main(int argc, char **argv) {
-    if (argc == 1) {
-        std::shared_ptr<std::istream> cin(static_cast<std::istream*>(&std::cin));
-        processFile(cin, "");
+    auto options = std::make_shared<cpp::Options>();
+    std::vector<std::string> files;
+    std::vector<std::pair<char, std::string>> macros;
+    std::shared_ptr<cpp::BinaryTokenWriter> binary;
+    std::shared_ptr<cpp::IncludeTracer> tracer;
+    std::string traceFile, indexFile, lookupName;
+    std::shared_ptr<cpp::CompactSink> compact;
+    std::shared_ptr<cpp::ManifestCache> cache;
+    // the flags that change the output, which cached output is keyed on
+    std::string flags;
+    bool memoryReport = false, fsStats = false, traceSummary = false, printHash = false, lineMarkers = false,
+         dumpMacros = false, scanDeps = false, jsonDeps = false, makeDeps = false;
+    // where dependencies go, standard output or FILE.d if empty
+    std::string depFile;
+    options->files = cpp::FileSystemCache::shared();
+    for (int i = 1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--pipeline") {
+            options->pipelined = true;
+        } else if (arg.compare(0, 7, "--jobs=") == 0) {
+            options->lexThreads = (unsigned) std::stoul(arg.substr(7));
+        } else if (arg == "--no-expansion-cache") {
+            options->cacheExpansions = false;
+        } else if (arg == "--prefetch") {
+            options->prefetcher = std::make_shared<cpp::IncludePrefetcher>(4, options);
+        } else if (arg.compare(0, 11, "--prefetch=") == 0) {
+            options->prefetcher = std::make_shared<cpp::IncludePrefetcher>((unsigned) std::stoul(arg.substr(11)), options);
+        } else if (arg.compare(0, 15, "--memory-limit=") == 0) {
+            auto limit = parseSize(arg.substr(15));
+            if (!options->memory)
+                options->memory = std::make_shared<cpp::MemoryBudget>(limit);
+            else
+                *options->memory = cpp::MemoryBudget(limit);
+        } else if (arg == "--memory-report") {
+            memoryReport = true;
+            if (!options->memory)
+                options->memory = std::make_shared<cpp::MemoryBudget>();
+        } else if (arg.compare(0, 20, "--max-include-depth=") == 0) {
+            options->maxIncludeDepth = (int) std::stoul(arg.substr(20));
+            flags += arg + "\n";
+        } else if (arg == "--splice-prepass") {
+            options->splicePrepass = true;
+        } else if (arg == "-trigraphs" || arg == "--trigraphs") {
+            options->trigraphs = true;
+            flags += "--trigraphs\n";
+        } else if (arg == "--no-fs-cache") {
+            options->files.reset();
+        } else if (arg == "--fs-stats") {
+            fsStats = true;
+        } else if (arg.compare(0, 8, "--trace=") == 0) {
+            traceFile = arg.substr(8);
+        } else if (arg == "--trace-summary") {
+            traceSummary = true;
+        } else if (arg == "--compact" || arg == "--line-markers") {
+            lineMarkers = arg == "--line-markers";
+            compact = std::make_shared<cpp::CompactSink>(std::cout, lineMarkers);
+            flags += arg + "\n";
+        } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+            cache = std::make_shared<cpp::ManifestCache>(arg.substr(12));
+        } else if (arg.compare(0, 8, "--index=") == 0) {
+            indexFile = arg.substr(8);
+        } else if (arg.compare(0, 9, "--lookup=") == 0) {
+            lookupName = arg.substr(9);
+        } else if (arg == "-M" || arg == "--deps-json") {
+            scanDeps = true;
+            jsonDeps = arg == "--deps-json";
+        } else if (arg == "-MD") {
+            makeDeps = true;
+        } else if (arg.compare(0, 3, "-MF") == 0) {
+            depFile = arg.substr(3);
+            if (depFile.empty() && i + 1 < argc)
+                depFile = argv[++i];
+        } else if (arg == "-dM") {
+            dumpMacros = true;
+        } else if (arg == "--print-hash") {
+            printHash = true;
+        } else if (arg == "--binary") {
+            binary = std::make_shared<cpp::BinaryTokenWriter>(std::cout);
+        } else if (arg == "--binary-locations") {
+            binary = std::make_shared<cpp::BinaryTokenWriter>(std::cout, true);
+        } else if (arg == "-imacros" && i + 1 < argc) {
+            macros.push_back(std::make_pair('i', std::string(argv[++i])));
+            flags += "-imacros " + macros.back().second + "\n";
+        } else if (arg.size() > 1 && arg[0] == '-' && (arg[1] == 'I' || arg[1] == 'D' || arg[1] == 'U')) {
+            auto value = arg.substr(2);
+            if (value.empty() && i + 1 < argc)
+                value = argv[++i];
+            if (arg[1] == 'I')
+                options->includePaths.push_back(value);
+            else
+                macros.push_back(std::make_pair(arg[1], value));
+            flags += arg.substr(0, 2) + value + "\n";
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (!lookupName.empty()) {
+        if (indexFile.empty()) {
+            std::cerr << "--lookup needs --index" << std::endl;
+            return 2;
+        }
+        return lookupMacro(indexFile, lookupName);
+    }
+    if (binary && (cache || printHash)) {
+        std::cerr << "Binary output is neither hashed nor cached" << std::endl;
+        cache.reset();
+        printHash = false;
+    }
+    if (makeDeps && cache) {
+        std::cerr << "Dependencies are not cached" << std::endl;
+        cache.reset();
+    }
+    auto callbacks = std::make_shared<cpp::CallbackList>();
+    auto recorder = std::make_shared<cpp::IncludeRecorder>();
+    if (!traceFile.empty() || traceSummary) {
+        tracer = std::make_shared<cpp::IncludeTracer>();
+        callbacks->callbacks.push_back(tracer);
+    }
+    if (cache || makeDeps)
+        callbacks->callbacks.push_back(recorder);
+    if (callbacks->callbacks.size() == 1)
+        options->callbacks = callbacks->callbacks[0];
+    else if (!callbacks->callbacks.empty())
+        options->callbacks = callbacks;
+
+    cpp::TextSink text(std::cout);
+    cpp::TokenSink &sink = binary? static_cast<cpp::TokenSink&>(*binary):
+                           compact? static_cast<cpp::TokenSink&>(*compact): text;
+    std::ostream *plain = !binary && !compact? &std::cout: nullptr;
+    bool clean;
+    // the command line macros are set up once and forked for every file
+    cpp::Preprocessor base(options);
+    for (const auto &macro: macros) {
+        auto i = macro.second.find('=');
+        if (macro.first == 'i')
+            base.addForcedInclude(macro.second);
+        else if (macro.first == 'U')
+            base.undef(macro.second);
+        else if (i == std::string::npos)
+            base.define(macro.second);
+        else
+            base.define(macro.second.substr(0, i), macro.second.substr(i + 1));
+    }
+    try {
+        base.prepare();
+    } catch (cpp::ParsingException &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    // what -imacros included goes into every manifest
+    auto forcedIncludes = recorder->files;
+    if (!indexFile.empty()) {
+        // only the files given are indexed again
+        cpp::MacroIndexWriter writer;
+        indexFiles(base, options, files, writer);
+        // other runs may be updating the index too: merge under a lock, and
+        // replace the file whole, since readers map it
+        auto lockPath = indexFile + ".lock";
+        auto lock = lockFile(lockPath);
+        {
+            cpp::MappedFile old(indexFile);
+            try {
+                if (old.isOpen())
+                    writer.load(cpp::MacroIndexReader(old.data(), old.size()));
+            } catch (cpp::ParsingException &e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+        std::stringstream os;
+        writer.write(os);
+        auto written = cpp::replaceFile(indexFile, os.str());
+        unlockFile(lockPath, lock);
+        if (!written) {
+            std::cerr << "Open file failed: " << indexFile << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (dumpMacros) {
+        // only the macros left at the end of each file are printed
+        if (files.empty())
+            files.push_back("");
+        int status = 0;
+        for (const auto &file: files) {
+            auto preprocessor = base.fork();
+            if (file.empty()) {
+                std::shared_ptr<std::istream> cin(static_cast<std::istream*>(&std::cin), [](std::istream*) {});
+                preprocessor->setInput(cin, "");
+            } else {
+                preprocessor->setInput(file);
+            }
+            try {
+                if (!preprocessor->runDirectives()) {
+                    std::cerr << "Open file failed: " << file << std::endl;
+                    status = 1;
+                    continue;
+                }
+            } catch (cpp::ParsingException &e) {
+                std::cerr << e.what() << std::endl;
+                status = 1;
+                continue;
+            }
+            cpp::writeDefines(std::cout, *preprocessor->macroTable());
+        }
+        return status;
+    }
+    std::ofstream deps;
+    if ((scanDeps || makeDeps) && !depFile.empty()) {
+        deps.open(depFile);
+        if (!deps.is_open()) {
+            std::cerr << "Open file failed: " << depFile << std::endl;
+            return 1;
+        }
+    }
+    if (scanDeps) {
+        if (files.empty()) {
+            std::cerr << "Dependencies are only scanned for files" << std::endl;
+            return 2;
+        }
+        std::vector<std::shared_ptr<cpp::IncludeRecorder>> includes;
+        bool ok = scanFiles(base, options, files, includes);
+        std::ostream &os = depFile.empty()? std::cout: deps;
+        if (jsonDeps)
+            os << '[';
+        bool first = true;
+        for (unsigned long i = 0; i<files.size(); i++) {
+            if (!includes[i])
+                continue;
+            auto all = forcedIncludes;
+            all.insert(all.end(), includes[i]->files.begin(), includes[i]->files.end());
+            if (!jsonDeps) {
+                writeMakeRule(os, files[i], all);
+                continue;
+            }
+            os << (first? "\n": ",\n") << "{\"file\": ";
+            writeJsonString(os, files[i]);
+            os << ", \"includes\": [";
+            for (unsigned long j = 0; j<all.size(); j++) {
+                if (j)
+                    os << ", ";
+                writeJsonString(os, all[j]);
+            }
+            os << "]}";
+            first = false;
+        }
+        if (jsonDeps)
+            os << "\n]\n";
+        return ok? 0: 1;
+    }
+    if (files.empty()) {
+        auto preprocessor = base.fork();
+        std::shared_ptr<std::istream> cin(static_cast<std::istream*>(&std::cin), [](std::istream*) {});
+        preprocessor->setInput(cin, "");
+        if (tracer)
+            tracer->beginFile("<stdin>");
+        if (printHash) {
+            cpp::HashingStream hashed(nullptr);
+            processFile(*preprocessor, hashed, compact != nullptr, lineMarkers, clean);
+            std::cout << hashed.finish() << "  -" << std::endl;
+        } else {
+            processFile(*preprocessor, sink, plain, clean);
+            if (compact)
+                compact->finish();
+        }
+        if (tracer)
+            tracer->endFile();
+        if (memoryReport)
+            std::cerr << "peak memory: " << options->memory->peak() << " bytes" << std::endl;
     } else {
-        for (int i = 1; i<argc; i++) {
-            auto input = std::make_shared<std::ifstream>();
-            input->open(argv[i]);
-            if (input->is_open()) {
-                processFile(input, argv[i]);
+        for (unsigned long i = 0; i<files.size(); i++) {
+            const auto &file = files[i];
+            // one file ahead, each pulling in its includes, keeps the read-ahead bounded
+            if (options->prefetcher) {
+                options->prefetcher->prefetch(file);
+                if (i + 1 < files.size())
+                    options->prefetcher->prefetch(files[i + 1]);
+            }
+            std::string key, hash, output;
+            if (cache && !(key = cache->key(file, flags)).empty() && !(hash = cache->lookup(key)).empty()) {
+                if (printHash) {
+                    std::cout << hash << "  " << file << std::endl;
+                    continue;
+                }
+                if (cache->load(hash, output)) {
+                    std::cout << output;
+                    continue;
+                }
+            }
+
+            auto preprocessor = base.fork();
+            preprocessor->setInput(file);
+            recorder->clear();
+            if (tracer)
+                tracer->beginFile(file);
+            bool opened;
+            if (cache || printHash) {
+                std::ostringstream captured;
+                cpp::HashingStream hashed(cache? &captured: nullptr);
+                opened = processFile(*preprocessor, hashed, compact != nullptr, lineMarkers, clean);
+                hash = hashed.finish();
+                if (opened && printHash)
+                    std::cout << hash << "  " << file << std::endl;
+                else
+                    std::cout << captured.str();
+                if (opened && clean && !key.empty()) {
+                    auto includes = forcedIncludes;
+                    includes.insert(includes.end(), recorder->files.begin(), recorder->files.end());
+                    cache->store(key, includes, captured.str(), hash);
+                }
             } else {
+                opened = processFile(*preprocessor, sink, plain, clean);
+                if (compact)
+                    compact->finish();
+            }
+            if (tracer)
+                tracer->endFile();
+            if (!opened) {
                 std::cerr << "Open file failed: ";
-                std::cerr << argv[i] << std::endl;
+                std::cerr << file << std::endl;
+            } else if (memoryReport) {
+                std::cerr << file << ": peak memory: " << options->memory->peak() << " bytes" << std::endl;
+            }
+            if (opened && clean && makeDeps) {
+                auto all = forcedIncludes;
+                all.insert(all.end(), recorder->files.begin(), recorder->files.end());
+                if (!depFile.empty()) {
+                    writeMakeRule(deps, file, all);
+                } else {
+                    auto dot = file.rfind('.');
+                    std::ofstream os((dot == std::string::npos || file.find('/', dot) != std::string::npos?
+                                      file: file.substr(0, dot)) + ".d");
+                    writeMakeRule(os, file, all);
+                }
             }
         }
     }
+    if (binary)
+        binary->finish();
+    if (!traceFile.empty()) {
+        std::ofstream os(traceFile);
+        if (os.is_open())
+            tracer->writeTrace(os);
+        else
+            std::cerr << "Open file failed: " << traceFile << std::endl;
+    }
+    if (traceSummary)
+        tracer->writeSummary(std::cerr);
+    if (fsStats && options->files) {
+        auto stats = options->files->stats();
+        std::cerr << "file lookups: " << stats.lookups << ", hits: " << stats.hits
+                  << " (" << stats.negativeHits << " missing), syscalls saved: " << stats.syscallsSaved << std::endl;
+    }
 }
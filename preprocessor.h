@@ -8,8 +8,18 @@
 #include <deque>
 #include <memory>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <string>
 #include <cstring>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
 
 namespace cpp {
 /*
@@ -281,14 +291,14 @@ namespace cpp {
             OTHER
         };
 
-        inline Token(token_type t, const std::string &v, const PosInfo &posInfo, bool nl = false):
-                _type(t), _value(v), _pos(posInfo), _hasNewLine(nl) { }
+        inline Token(token_type t, const std::string &v, const PosInfo &posInfo, bool nl = false, bool ls = false):
+                _type(t), _value(v), _pos(posInfo), _hasNewLine(nl), _leadingSpace(ls) { }
 
         inline token_type type() const {
             return _type;
         }
 
-        inline std::string value() const {
+        inline const std::string &value() const {
             return _value;
         }
 
@@ -296,7 +306,20 @@ namespace cpp {
             return _hasNewLine;
         }
 
-        inline PosInfo pos() const {
+        /*
+         * Whether a space goes before this token. Macro bodies and
+         * expansions keep their whitespace this way instead of as
+         * WHITESPACE tokens; the lexer still emits those, which stand for
+         * themselves, so the flag is only set on tokens that did not come
+         * straight from the source. There is no start-of-line flag: line
+         * breaks are only known from the WHITESPACE tokens, which the
+         * directive parser, the token caches and the output rely on.
+         */
+        inline bool leadingSpace() const {
+            return _leadingSpace;
+        }
+
+        inline const PosInfo &pos() const {
             return _pos;
         }
 
@@ -305,10 +328,29 @@ namespace cpp {
         const PosInfo _pos;
         std::string _value;
         bool _hasNewLine;
+        bool _leadingSpace;
     };
 
     typedef std::shared_ptr<Token> token_t;
 
+    /* token itself if its leadingSpace is already space, otherwise a copy with it */
+    inline token_t withLeadingSpace(token_t token, bool space) {
+        if (token->leadingSpace() == space)
+            return token;
+        return std::make_shared<Token>(token->type(), token->value(), token->pos(), token->hasNewLine(), space);
+    }
+
+    /* whether a space has to be written before token when it follows prev */
+    inline bool spaceBefore(const Token *prev, const Token &token) {
+        return token.leadingSpace() && prev && prev->type() != Token::WHITESPACE;
+    }
+
+    /* whether s[0..n) lexes as exactly one token, and of which type */
+    bool isSingleToken(const char *s, unsigned long n, Token::token_type &type);
+
+    /* whether b written right after a, of type at, would not lex back as a and b */
+    bool wouldPaste(const char *a, unsigned long an, Token::token_type at, const char *b, unsigned long bn);
+
     class Macro {
     public:
         inline Macro(const std::string &n, bool f = false):
@@ -330,8 +372,18 @@ namespace cpp {
             return _body;
         }
 
+        /* keeps body without WHITESPACE tokens, see Token::leadingSpace */
         inline void setBody(const std::deque<token_t> &body) {
-            _body = body;
+            _body.clear();
+            bool ws = false;
+            for (const auto &token: body) {
+                if (token->type() == Token::WHITESPACE) {
+                    ws = true;
+                } else {
+                    _body.push_back(withLeadingSpace(token, (ws || token->leadingSpace()) && !_body.empty()));
+                    ws = false;
+                }
+            }
         }
     private:
         bool _isFunctionLike;
@@ -355,7 +407,45 @@ namespace cpp {
         std::deque<std::string> _params;
     };
 
-    typedef std::shared_ptr<std::map<std::string, std::shared_ptr<Macro>>> macro_table_t;
+    typedef std::shared_ptr<const std::vector<token_t>> token_range_t;
+
+#define EXPANSION_CACHE_SIZE 4096
+    /*
+     * Fully expanded bodies of macros, keyed by the macro, its arguments and
+     * the names hidden while expanding it. Every entry is dropped as soon as
+     * the generation of the table it belongs to moves on.
+     */
+    class ExpansionCache {
+    public:
+        inline ExpansionCache():
+                entries(), generation(0), hits(0), misses(0) {}
+
+        inline token_range_t find(const std::string &key, unsigned long gen) {
+            if (gen != generation) {
+                entries.clear();
+                generation = gen;
+            }
+            auto it = entries.find(key);
+            if (it == entries.end()) {
+                misses++;
+                return token_range_t();
+            }
+            hits++;
+            return it->second;
+        }
+
+        inline void insert(const std::string &key, unsigned long gen, token_range_t tokens) {
+            if (gen != generation || entries.size() >= EXPANSION_CACHE_SIZE) {
+                entries.clear();
+                generation = gen;
+            }
+            entries[key] = tokens;
+        }
+
+        std::unordered_map<std::string, token_range_t> entries;
+        unsigned long generation;
+        unsigned long hits, misses;
+    };
 
     class ParsingException: public std::exception {
     public:
@@ -373,24 +463,298 @@ namespace cpp {
         virtual const char *what() throw() {
             return messageWithPos;
         }
+
+        inline const std::string &message() const {
+            return msg;
+        }
+
+        inline const PosInfo &position() const {
+            return pos;
+        }
     private:
         const std::string msg;
         char *messageWithPos;
         const PosInfo pos;
     };
 
+    /* the bytes a token holds on to */
+    inline unsigned long footprint(const Token &token) {
+        return sizeof(Token) + sizeof(token_t) + token.value().size() + token.pos().file.size();
+    }
+
+    inline unsigned long footprint(const Macro &macro) {
+        unsigned long n = sizeof(Macro) + macro.name().size();
+        for (const auto &token: macro.body())
+            n += footprint(*token);
+        return n;
+    }
+
+    /*
+     * Accounts for the memory held by directive lines, macro arguments and
+     * macro bodies, and throws ParsingException instead of going past the
+     * limit. A limit of 0 only keeps count.
+     */
+    class MemoryBudget {
+    public:
+        inline MemoryBudget(unsigned long l = 0):
+                _limit(l), _current(0), _peak(0) {}
+
+        inline unsigned long limit() const {
+            return _limit;
+        }
+
+        inline unsigned long current() const {
+            return _current;
+        }
+
+        inline unsigned long peak() const {
+            return _peak;
+        }
+
+        inline void charge(unsigned long n, const PosInfo &pos) {
+            if (_limit && n > _limit - _current)
+                throw ParsingException(("Memory budget of " + std::to_string(_limit) + " bytes exceeded, " +
+                                        std::to_string(_current) + " bytes in use").c_str(), pos);
+            _current += n;
+            if (_current > _peak)
+                _peak = _current;
+        }
+
+        inline void release(unsigned long n) {
+            _current -= n < _current? n: _current;
+        }
+
+        inline void resetPeak() {
+            _peak = _current;
+        }
+    private:
+        unsigned long _limit, _current, _peak;
+    };
+
+    /* charges made through it are released when it goes out of scope */
+    class BudgetCharge {
+    public:
+        inline BudgetCharge(std::shared_ptr<MemoryBudget> b):
+                budget(b), total(0) {}
+
+        inline ~BudgetCharge() {
+            if (budget)
+                budget->release(total);
+        }
+
+        BudgetCharge(const BudgetCharge &) = delete;
+        BudgetCharge &operator=(const BudgetCharge &) = delete;
+
+        inline void charge(const Token &token) {
+            if (budget) {
+                auto n = footprint(token);
+                budget->charge(n, token.pos());
+                total += n;
+            }
+        }
+    private:
+        std::shared_ptr<MemoryBudget> budget;
+        unsigned long total;
+    };
+
+    /* a frozen set of definitions over the layers below it; a null macro hides the name below */
+    class MacroLayer {
+    public:
+        inline MacroLayer(std::map<std::string, std::shared_ptr<Macro>> &&m, std::shared_ptr<const MacroLayer> p):
+                macros(std::move(m)), parent(p), depth(p? p->depth + 1: 1) {}
+
+        const std::map<std::string, std::shared_ptr<Macro>> macros;
+        const std::shared_ptr<const MacroLayer> parent;
+        const unsigned depth;
+    };
+
+#define MACRO_LAYER_MAX_DEPTH 8
+    /*
+     * The macros defined so far; every #define and #undef starts a new
+     * generation. With a budget, the bodies are charged to it until they
+     * are undefined or the table goes away.
+     *
+     * Definitions go into a private top layer over frozen layers that may
+     * be shared with other tables. fork() freezes the top and hands out a
+     * table over the same layers, so forking is cheap and each fork only
+     * holds what it changes.
+     */
+    class MacroTable {
+    public:
+        inline MacroTable(std::shared_ptr<MemoryBudget> b = std::shared_ptr<MemoryBudget>()):
+                macros(), parent(), _generation(0), _expansions(), budget(b), charged(0) {}
+
+        inline ~MacroTable() {
+            if (budget)
+                budget->release(charged);
+        }
+
+        inline std::shared_ptr<Macro> find(const std::string &name) const {
+            auto it = macros.find(name);
+            if (it != macros.end())
+                return it->second;
+            for (auto layer = parent.get(); layer; layer = layer->parent.get()) {
+                auto it = layer->macros.find(name);
+                if (it != layer->macros.end())
+                    return it->second;
+            }
+            return std::shared_ptr<Macro>();
+        }
+
+        inline void define(std::shared_ptr<Macro> macro, const PosInfo &pos = posStart) {
+            if (budget) {
+                auto n = footprint(*macro);
+                budget->charge(n, pos);
+                charged += n;
+            }
+            auto &slot = macros[macro->name()];
+            if (slot)
+                discharge(*slot);
+            slot = macro;
+            _generation++;
+        }
+
+        inline void undef(const std::string &name) {
+            auto it = macros.find(name);
+            if (it != macros.end() && it->second) {
+                discharge(*it->second);
+                macros.erase(it);
+            } else if (it != macros.end() || !find(name)) {
+                return;
+            }
+            // hide a definition made before the last fork
+            if (parent && find(name))
+                macros[name] = std::shared_ptr<Macro>();
+            _generation++;
+        }
+
+        /* a table that starts out with the same macros as this one */
+        std::shared_ptr<MacroTable> fork() {
+            freeze();
+            auto table = std::make_shared<MacroTable>(budget);
+            table->parent = parent;
+            table->_generation = _generation;
+            return table;
+        }
+
+        /* every macro visible, by name */
+        std::map<std::string, std::shared_ptr<Macro>> visible() const {
+            std::map<std::string, std::shared_ptr<Macro>> result;
+            for (auto &entry: macros)
+                result.insert(entry);
+            for (auto layer = parent.get(); layer; layer = layer->parent.get()) {
+                for (auto &entry: layer->macros)
+                    result.insert(entry);
+            }
+            for (auto it = result.begin(); it != result.end();) {
+                if (it->second)
+                    ++it;
+                else
+                    it = result.erase(it);
+            }
+            return result;
+        }
+
+        inline unsigned long generation() const {
+            return _generation;
+        }
+
+        inline ExpansionCache &expansions() {
+            return _expansions;
+        }
+    private:
+        inline void discharge(const Macro &macro) {
+            if (budget) {
+                auto n = footprint(macro);
+                budget->release(n);
+                charged -= n;
+            }
+        }
+
+        void freeze() {
+            if (macros.empty())
+                return;
+            if (parent && parent->depth >= MACRO_LAYER_MAX_DEPTH) {
+                // keep lookups short by squashing the layers into one
+                auto all = visible();
+                parent = std::make_shared<MacroLayer>(std::move(all), std::shared_ptr<const MacroLayer>());
+                macros.clear();
+                return;
+            }
+            parent = std::make_shared<MacroLayer>(std::move(macros), parent);
+            macros.clear();
+        }
+
+        std::map<std::string, std::shared_ptr<Macro>> macros;
+        std::shared_ptr<const MacroLayer> parent;
+        unsigned long _generation;
+        ExpansionCache _expansions;
+        std::shared_ptr<MemoryBudget> budget;
+        unsigned long charged;
+    };
+
+    typedef std::shared_ptr<MacroTable> macro_table_t;
+
+    class IncludePrefetcher;
+    class PreprocessorCallbacks;
+    class FileSystemCache;
+    class DirectiveCache;
+
+#define MAX_INCLUDE_RECURSION 15
+
+    class Options {
+    public:
+        inline Options():
+                pipelined(false), lexThreads(0), prefetcher(), cacheExpansions(true),
+                includePaths(), callbacks(), memory(), files(), maxIncludeDepth(MAX_INCLUDE_RECURSION),
+                splicePrepass(false), trigraphs(false), skipText(false), directives() {}
+
+        /* lex piped files and those of PIPELINE_MIN_SIZE or more on their own thread, given a spare core, see PipelinedTokenizer */
+        bool pipelined;
+        /* split large files into chunks lexed in parallel, see tokenizeParallel; not with splicePrepass or trigraphs */
+        unsigned lexThreads;
+        /* loads quoted includes ahead of the parser, see IncludePrefetcher */
+        std::shared_ptr<IncludePrefetcher> prefetcher;
+        /* reuse earlier expansions of a macro, see ExpansionCache; not done while callbacks are set */
+        bool cacheExpansions;
+        /* searched for <> includes, and for "" includes not found next to their includer */
+        std::vector<std::string> includePaths;
+        std::shared_ptr<PreprocessorCallbacks> callbacks;
+        /* null when memory is not accounted for */
+        std::shared_ptr<MemoryBudget> memory;
+        /* remembers which files exist, see FileSystemCache */
+        std::shared_ptr<FileSystemCache> files;
+        /* includes nested deeper than this are left as they are */
+        int maxIncludeDepth;
+        /* splice lines before lexing, see spliceLines */
+        bool splicePrepass;
+        /* replace trigraphs, which needs splicePrepass */
+        bool trigraphs;
+        /* drop text lines like those in a failed #if, see Preprocessor::runDirectives */
+        bool skipText;
+        /* when set, files are read minimized to their directives, see DirectiveCache */
+        std::shared_ptr<DirectiveCache> directives;
+    };
+
+    typedef std::shared_ptr<Options> options_t;
+
     inline void unexpected(int c, const PosInfo &pos) {
         throw ParsingException((std::string("Unexpected '") + escape(c) + (char) '\'').c_str(), pos);
     }
 
     class MacroExpander;
+    class DirectiveParser;
+
+#define TOKEN_BATCH_SIZE 256
 
     class TokenStream {
     public:
         inline TokenStream():
-                buffer() {}
+                buffer(), batchError() {}
         inline TokenStream(const std::deque<token_t> &buf):
-                buffer(buf) {}
+                buffer(buf), batchError() {}
+        inline TokenStream(std::deque<token_t> &&buf):
+                buffer(std::move(buf)), batchError() {}
 
         inline bool finished() const {
             return buffer.empty() && _finished();
@@ -413,6 +777,8 @@ namespace cpp {
 
         inline token_t next() {
             if (buffer.empty()) {
+                if (batchError)
+                    rethrowBatchError();
                 return _next();
             } else {
                 auto token = buffer[0];
@@ -425,10 +791,65 @@ namespace cpp {
             return token_t();
         }
 
+        /*
+         * Takes up to n tokens, usually TOKEN_BATCH_SIZE, into out, whose
+         * slots must be empty, and returns how many. Fewer than n come back
+         * only at the end, or before an error, which the next call to
+         * nextBatch or next() throws. The two may be mixed.
+         */
+        unsigned long nextBatch(token_t *out, unsigned long n);
+
+        virtual unsigned long _nextBatch(token_t *out, unsigned long n) {
+            unsigned long count = 0;
+            while (count < n && (out[count] = next()))
+                count++;
+            return count;
+        }
+
+        /* next() for a stream of the final class T, calling T::_next without the vtable */
+        template <class T>
+        inline token_t nextAs() {
+            if (buffer.empty()) {
+                if (batchError)
+                    rethrowBatchError();
+                return static_cast<T*>(this)->T::_next();
+            } else {
+                auto token = buffer[0];
+                buffer.pop_front();
+                return token;
+            }
+        }
+
+        /* _nextBatch for a stream of the final class T, one loop without the vtable */
+        template <class T>
+        inline unsigned long nextBatchAs(token_t *out, unsigned long n) {
+            unsigned long count = 0;
+            while (count < n && (out[count] = nextAs<T>()))
+                count++;
+            return count;
+        }
+
+        /*
+         * Passes over text on the current line without making tokens of
+         * it, for lines that are dropped anyway. It may stop anywhere
+         * before the line break; next() lexes the rest.
+         */
+        inline void skipText() {
+            if (buffer.empty())
+                _skipText();
+        }
+
+        virtual void _skipText() {}
+
         inline void unget(token_t token) {
             buffer.push_front(token);
         }
 
+        /*
+         * Takes the WHITESPACE token that comes next, if any. Only lexed
+         * text has them; on a macro body or an expansion this just puts
+         * back the token it looked at.
+         */
         inline token_t space(bool allowNewLine = true) {
             auto token = next();
             if (token && (token->type() != Token::WHITESPACE ||
@@ -509,32 +930,222 @@ namespace cpp {
         inline void print(std::ostream &os) {
             auto prev = token_t();
             while (auto token = next()) {
-                /*if (prev) {
-                    if (prev->type() == Token::NUMBER ||
-                            prev->type() == Token::IDENTIFIER ||
-                            prev-> type() == Token::PUNC) {
-                        os << ' ';
-                    }
-                }*/
+                if (spaceBefore(prev.get(), *token))
+                    os << ' ';
                 os << token->value();
+                prev = token;
             }
         }
 
     private:
+        void rethrowBatchError();
+
         std::deque<token_t> buffer;
+        /* an error after the tokens of the last batch */
+        std::exception_ptr batchError;
+    };
+
+    /*
+     * The stream a stage reads from. Stages are put together at run time,
+     * but the one before is nearly always of the final class T; its
+     * tokens are then taken with nextAs, which the compiler can inline
+     * into the reading loop. Any other TokenStream is read through the
+     * virtual interface.
+     */
+    template <class T>
+    class StageInput {
+    public:
+        inline StageInput():
+                stream(nullptr), direct(nullptr) {}
+
+        inline void reset(TokenStream *s) {
+            stream = s;
+            direct = dynamic_cast<T*>(s);
+        }
+
+        inline token_t next() {
+            return direct? direct->template nextAs<T>(): stream->next();
+        }
+    private:
+        TokenStream *stream;
+        T *direct;
+    };
+
+    /*
+     * Read-only stream buffer over bytes owned by someone else,
+     * with the seeking the Tokenizer relies on.
+     */
+    class MemoryBuffer: public std::streambuf {
+    public:
+        inline MemoryBuffer(const char *data, unsigned long size) {
+            char *p = const_cast<char*>(data);
+            setg(p, p, p + size);
+        }
+
+        /* the bytes not read yet, for scanning them in place */
+        inline const char *current() const {
+            return gptr();
+        }
+
+        inline const char *end() const {
+            return egptr();
+        }
+
+        inline void skip(unsigned long n) {
+            setg(eback(), gptr() + n, egptr());
+        }
+    protected:
+        virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                                 std::ios_base::openmode which = std::ios_base::in) {
+            char *p = dir == std::ios_base::beg? eback():
+                      dir == std::ios_base::cur? gptr(): egptr();
+            return seekpos(pos_type(p - eback() + off), which);
+        }
+
+        virtual pos_type seekpos(pos_type p, std::ios_base::openmode which = std::ios_base::in) {
+            off_type off(p);
+            if (!(which & std::ios_base::in) || off < 0 || off > egptr() - eback())
+                return pos_type(off_type(-1));
+            setg(eback(), eback() + off, egptr());
+            return p;
+        }
     };
 
-    class Tokenizer: public TokenStream {
+    /*
+     * An istream reading a MemoryBuffer. The buffer is owned by the stream;
+     * the bytes are too if they were moved in as a string.
+     */
+    class MemoryStream: public std::istream {
     public:
-        inline Tokenizer(std::shared_ptr<std::istream> i, const std::string &f):
-                TokenStream(), input(i), tokenBuffer(), pos(f), startPos(f), hasReturn(false) {}
+        inline MemoryStream(const char *data, unsigned long size):
+                std::istream(nullptr), owned(), buffer(data, size) {
+            rdbuf(&buffer);
+        }
+
+        inline MemoryStream(std::string &&data):
+                std::istream(nullptr), owned(std::move(data)), buffer(owned.data(), owned.size()) {
+            rdbuf(&buffer);
+        }
+    private:
+        std::string owned;
+        MemoryBuffer buffer;
+    };
+
+#define REPLAY_BLOCK_SIZE (64ul << 10)
+    /*
+     * Reads a stream that cannot seek, like a pipe, a block at a time and
+     * keeps every byte read so far, so that the tokenizer can seek back
+     * over them as it does in a file. The end is the end of what has
+     * been read.
+     */
+    class ReplayBuffer: public std::streambuf {
+    public:
+        inline ReplayBuffer(std::shared_ptr<std::istream> s):
+                source(s), data() {}
+    protected:
+        virtual int_type underflow() {
+            if (gptr() < egptr())
+                return traits_type::to_int_type(*gptr());
+            auto offset = gptr() - eback();
+            auto size = data.size();
+            data.resize(size + REPLAY_BLOCK_SIZE);
+            source->read(&data[size], REPLAY_BLOCK_SIZE);
+            data.resize(size + source->gcount());
+            setg(&data[0], &data[0] + offset, &data[0] + data.size());
+            return gptr() < egptr()? traits_type::to_int_type(*gptr()): traits_type::eof();
+        }
+
+        virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                                 std::ios_base::openmode which = std::ios_base::in) {
+            char *p = dir == std::ios_base::beg? eback():
+                      dir == std::ios_base::cur? gptr(): egptr();
+            return seekpos(pos_type(p - eback() + off), which);
+        }
+
+        virtual pos_type seekpos(pos_type p, std::ios_base::openmode which = std::ios_base::in) {
+            off_type off(p);
+            if (!(which & std::ios_base::in) || off < 0 || off > egptr() - eback())
+                return pos_type(off_type(-1));
+            setg(eback(), eback() + off, egptr());
+            return p;
+        }
+    private:
+        std::shared_ptr<std::istream> source;
+        std::string data;
+    };
+
+    /* an istream reading a ReplayBuffer over source */
+    class ReplayStream: public std::istream {
+    public:
+        inline ReplayStream(std::shared_ptr<std::istream> source):
+                std::istream(nullptr), buffer(source) {
+            rdbuf(&buffer);
+        }
+    private:
+        ReplayBuffer buffer;
+    };
+
+    /*
+     * What translation phases 1 and 2 changed in a file: every trigraph
+     * replaced and line splice removed, in order. Positions in the
+     * logical text are mapped back to the physical line and column
+     * they came from.
+     */
+    class SourceMap {
+    public:
+        class Edit {
+        public:
+            /* logical bytes [begin, end) replace the original physical bytes */
+            unsigned long begin, end;
+            /* the physical offset and column of end */
+            unsigned long physical;
+            int col;
+            /* line breaks removed up to and including this edit */
+            int lines;
+            std::string original;
+        };
+
+        inline bool empty() const {
+            return edits.empty();
+        }
+
+        PosInfo physical(const PosInfo &logical) const;
+
+        /* logical bytes [b, e), starting at logical offset, as they were written */
+        std::string original(const char *b, const char *e, unsigned long offset) const;
+
+        std::vector<Edit> edits;
+    };
+
+    /*
+     * Runs phases 1 and 2 over a file: replaces trigraphs if asked to
+     * and removes line splices. Returns false, leaving logical and map
+     * empty, when the file has neither.
+     */
+    bool spliceLines(const char *data, unsigned long size, bool trigraphs, std::string &logical, SourceMap &map);
+
+    class Tokenizer final: public TokenStream {
+    public:
+        /* with a source map the input has been through spliceLines */
+        inline Tokenizer(std::shared_ptr<std::istream> i, const std::string &f,
+                         std::shared_ptr<const SourceMap> m = std::shared_ptr<const SourceMap>()):
+                TokenStream(), input(i), memory(dynamic_cast<MemoryBuffer*>(i->rdbuf())), sourceMap(m),
+                tokenBuffer(), pos(f), startPos(f), logicalStart(f), hasReturn(false) {}
+
+        /* continue lexing at byte offset p, which is known to be at position at */
+        inline void seek(std::streampos p, const PosInfo &at, bool afterReturn) {
+            input->clear();
+            input->seekg(p);
+            pos = at;
+            hasReturn = afterReturn;
+        }
 
         virtual bool _finished() const {
             return input->eof();
         }
 
         virtual PosInfo _getPos() const {
-            return pos;
+            return sourceMap? sourceMap->physical(pos): pos;
         }
 
         void spliceLine();
@@ -543,7 +1154,8 @@ namespace cpp {
 
         inline void advance() {
             advanceRaw();
-            spliceLine();
+            if (!sourceMap)
+                spliceLine();
         }
 
         inline int matchRaw(int c, bool output = true) {
@@ -579,12 +1191,42 @@ namespace cpp {
         token_t parseRawString();
 
         virtual token_t _next();
+
+        virtual unsigned long _nextBatch(token_t *out, unsigned long n) {
+            return nextBatchAs<Tokenizer>(out, n);
+        }
+
+        virtual void _skipText();
     private:
+        token_t lex();
+
         inline void startToken() {
             startPos = pos;
+            if (sourceMap) {
+                logicalStart = pos;
+                startPos = sourceMap->physical(pos);
+            }
             tokenBuffer.str("");
         }
 
+        /* back to where the token started */
+        inline void restartToken() {
+            pos = sourceMap? logicalStart: startPos;
+        }
+
+        /*
+         * Fast paths for input in a MemoryBuffer: whole literals and
+         * comments are found with a vectorized or memchr search and taken
+         * as spans of the buffer. They give up, consuming nothing, on
+         * anything unusual (line splices, bad escapes, unterminated
+         * literals) and leave it to the byte by byte code, which reports
+         * errors.
+         */
+        token_t scanCharSequence(char quote, Token::token_type type);
+        token_t scanRawString();
+        bool scanComment();
+        void skipSpan(const char *p, unsigned long n);
+
         inline void hex();
 
         inline void oct() {
@@ -596,12 +1238,340 @@ namespace cpp {
         }
 
         std::shared_ptr<std::istream> input;
+        /* input's buffer if the whole input is in memory */
+        MemoryBuffer *memory;
+        std::shared_ptr<const SourceMap> sourceMap;
         std::stringstream tokenBuffer;
+        /* pos is in the logical text; startPos, where tokens are put, is physical */
         PosInfo pos;
         PosInfo startPos;
+        PosInfo logicalStart;
         bool hasReturn;
     };
 
+    /*
+     * Lock-free single-producer/single-consumer ring buffer.
+     * One slot is kept free to tell a full ring from an empty one.
+     */
+    template <class T, unsigned long N>
+    class SpscQueue {
+    public:
+        inline SpscQueue():
+                head(0), tail(0) {}
+
+        inline bool push(T &&v) {
+            auto t = tail.load(std::memory_order_relaxed);
+            auto n = (t + 1) % N;
+            if (n == head.load(std::memory_order_acquire))
+                return false;
+            slots[t] = std::move(v);
+            tail.store(n, std::memory_order_release);
+            return true;
+        }
+
+        inline bool pop(T &v) {
+            auto h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+            v = std::move(slots[h]);
+            head.store((h + 1) % N, std::memory_order_release);
+            return true;
+        }
+
+        inline bool empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+        inline bool full() const {
+            return (tail.load(std::memory_order_acquire) + 1) % N == head.load(std::memory_order_acquire);
+        }
+    private:
+        T slots[N];
+        alignas(64) std::atomic<unsigned long> head;
+        alignas(64) std::atomic<unsigned long> tail;
+    };
+
+#define PIPELINE_CHUNK_SIZE TOKEN_BATCH_SIZE
+#define PIPELINE_QUEUE_SIZE 64
+#define PIPELINE_SPINS 64
+#define PIPELINE_MIN_SIZE (64ul << 10)
+    typedef std::vector<token_t> token_chunk_t;
+
+    /*
+     * Runs a Tokenizer on its own thread and hands its tokens over in
+     * chunks through a SpscQueue. A seekable input up to
+     * MEMORY_LEX_MAX_SIZE is read into memory on that thread first. Lexing errors are rethrown on the
+     * consumer side once every token before them has been delivered.
+     * A side that finds the queue full or empty yields PIPELINE_SPINS
+     * times, then sleeps until the other side wakes it.
+     */
+    class PipelinedTokenizer: public TokenStream {
+    public:
+        PipelinedTokenizer(std::shared_ptr<std::istream> i, const std::string &f,
+                           std::shared_ptr<const SourceMap> m = std::shared_ptr<const SourceMap>());
+        virtual ~PipelinedTokenizer();
+
+        virtual bool _finished() const;
+        virtual PosInfo _getPos() const;
+        virtual token_t _next();
+        virtual unsigned long _nextBatch(token_t *out, unsigned long n);
+    private:
+        bool fill() const;
+        void produce();
+        template <class Ready>
+        void await(Ready ready) const;
+        void wake() const;
+
+        std::shared_ptr<std::istream> input;
+        std::shared_ptr<const SourceMap> sourceMap;
+        /* made on the producer thread, once the input has been read */
+        std::unique_ptr<Tokenizer> tokenizer;
+        SpscQueue<token_chunk_t, PIPELINE_QUEUE_SIZE> queue;
+        mutable token_chunk_t chunk;
+        mutable unsigned long index;
+        std::atomic<bool> done;
+        std::atomic<bool> stop;
+        std::exception_ptr error;
+        PosInfo endPos;
+        mutable std::mutex mutex;
+        mutable std::condition_variable changed;
+        mutable std::atomic<int> sleeping;
+        std::thread thread;
+    };
+
+    /*
+     * Tokens lexed ahead of time, either owned or shared with whoever
+     * lexed them. An error met while lexing them is rethrown once the
+     * tokens before it have been consumed.
+     */
+    class LexedTokenStream: public TokenStream {
+    public:
+        inline LexedTokenStream(std::deque<token_t> &&tokens, const PosInfo &end, std::exception_ptr e = std::exception_ptr()):
+                TokenStream(std::move(tokens)), shared(), index(0), endPos(end), error(e) {}
+        inline LexedTokenStream(token_range_t tokens, const PosInfo &end, std::exception_ptr e = std::exception_ptr()):
+                TokenStream(), shared(tokens), index(0), endPos(end), error(e) {}
+
+        virtual bool _finished() const {
+            return (!shared || index >= shared->size()) && !error;
+        }
+
+        virtual PosInfo _getPos() const {
+            return shared && index < shared->size()? (*shared)[index]->pos(): endPos;
+        }
+
+        virtual token_t _next() {
+            if (shared && index < shared->size())
+                return (*shared)[index++];
+            if (error) {
+                auto e = error;
+                error = std::exception_ptr();
+                std::rethrow_exception(e);
+            }
+            return token_t();
+        }
+
+        virtual unsigned long _nextBatch(token_t *out, unsigned long n) {
+            if (!shared || index >= shared->size())
+                return TokenStream::_nextBatch(out, n);
+            auto m = std::min(n, (unsigned long) shared->size() - index);
+            std::copy(shared->begin() + index, shared->begin() + index + m, out);
+            index += m;
+            return m;
+        }
+    private:
+        token_range_t shared;
+        unsigned long index;
+        PosInfo endPos;
+        std::exception_ptr error;
+    };
+
+    /* a stream over tokens shared with someone else */
+    class TokenRange: public TokenStream {
+    public:
+        inline TokenRange(token_range_t t):
+                TokenStream(), tokens(t), index(0) {}
+
+        virtual bool _finished() const {
+            return index >= tokens->size();
+        }
+
+        virtual PosInfo _getPos() const {
+            return index < tokens->size()? (*tokens)[index]->pos(): posStart;
+        }
+
+        virtual token_t _next() {
+            return index < tokens->size()? (*tokens)[index++]: token_t();
+        }
+
+        virtual unsigned long _nextBatch(token_t *out, unsigned long n) {
+            auto begin = tokens->begin() + std::min(index, (unsigned long) tokens->size());
+            auto m = std::min(n, (unsigned long) (tokens->end() - begin));
+            std::copy(begin, begin + m, out);
+            index += m;
+            return m;
+        }
+    private:
+        token_range_t tokens;
+        unsigned long index;
+    };
+
+#define PARALLEL_LEX_MIN_CHUNK (1 << 20)
+    std::shared_ptr<LexedTokenStream> tokenizeParallel(const char *data, unsigned long size, const std::string &file, unsigned threads,
+                                                       unsigned long minChunk = PARALLEL_LEX_MIN_CHUNK);
+
+    /* resolves a quoted include path against the file including it */
+    inline void resolve(const std::string &base, const std::string &path, std::string &result) {
+        if (path[0] == '/') {
+            result = path;
+        } else {
+            auto i = base.rfind('/');
+            if (i == std::string::npos) {
+                result = path;
+            } else {
+                result = base.substr(0, i + 1) + path;
+            }
+        }
+    }
+
+#define PREFETCH_CAPACITY 64
+    /*
+     * Loads and lexes files on a pool of I/O threads before the parser
+     * asks for them. Every loaded file is scanned for #include lines,
+     * regardless of the conditionals around them, and the files those
+     * name are queued in turn. Files are lexed as makeTokenizer would
+     * with the options at the time; they are held weakly, since the
+     * options hold the prefetcher.
+     *
+     * At most capacity files are queued or held at once: when full, the
+     * oldest loaded file is evicted, taken or not, and if every file is
+     * still loading the new one is not queued.
+     */
+    class IncludePrefetcher {
+    public:
+        IncludePrefetcher(unsigned threads, std::weak_ptr<Options> options = std::weak_ptr<Options>(),
+                          unsigned long capacity = PREFETCH_CAPACITY);
+        ~IncludePrefetcher();
+
+        void prefetch(const std::string &path);
+        void scan(const std::string &file, const char *data, unsigned long size);
+
+        /*
+         * Waits for a queued file. Returns false if path is not queued or
+         * held; otherwise stream is its tokens, which stay held for the
+         * next include of the same file, or null if it could not be opened.
+         */
+        bool take(const std::string &path, std::shared_ptr<TokenStream> &stream);
+    private:
+        class Entry {
+        public:
+            inline Entry():
+                    ready(false), opened(false), tokens(), endPos(""), error() {}
+
+            bool ready, opened;
+            token_range_t tokens;
+            PosInfo endPos;
+            std::exception_ptr error;
+        };
+
+        void work();
+        void load(const std::string &path);
+        bool evict();
+
+        std::mutex mutex;
+        std::condition_variable queued, loaded;
+        std::deque<std::string> queue;
+        std::map<std::string, std::shared_ptr<Entry>> entries;
+        /* the paths in entries, oldest first */
+        std::deque<std::string> order;
+        std::weak_ptr<Options> options;
+        unsigned long capacity;
+        bool stopping;
+        std::vector<std::thread> workers;
+    };
+
+    class FileInfo {
+    public:
+        inline FileInfo():
+                exists(false), canonical(), device(0), inode(0), size(0), mtime(0) {}
+
+        bool exists;
+        /* empty until asked for, see FileSystemCache::canonical */
+        std::string canonical;
+        unsigned long device, inode, size;
+        long mtime;
+    };
+
+    /*
+     * What stat said about each path asked for, including the paths that
+     * do not exist, so that include directories are not probed again for
+     * every translation unit. Safe to share between threads.
+     */
+    class FileSystemCache {
+    public:
+        inline FileSystemCache():
+                mutex(), entries(), lookups(0), hits(0), negativeHits(0) {}
+
+        /* the cache shared by everything in this process */
+        static std::shared_ptr<FileSystemCache> shared();
+
+        FileInfo lookup(const std::string &path);
+        /* the real path of an existing file, resolved once when first asked for */
+        std::string canonical(const std::string &path);
+        /* forgets everything, e.g. between runs */
+        void invalidate();
+        void invalidate(const std::string &path);
+        /* forgets the paths whose stat has changed since they were cached */
+        unsigned long revalidate();
+
+        class Stats {
+        public:
+            unsigned long lookups, hits, negativeHits;
+            /*
+             * the opens negative hits did not attempt, less the stat each
+             * miss made; a positive hit still opens the file
+             */
+            long syscallsSaved;
+        };
+
+        Stats stats() const;
+    private:
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, FileInfo> entries;
+        unsigned long lookups, hits, negativeHits;
+    };
+
+    /*
+     * Copies the directive lines of a file into out, with every other
+     * line left empty so that the directives keep their positions. Lines
+     * are told apart as the Tokenizer would, past comments, literals and
+     * splices; errors in the lines dropped go unnoticed.
+     */
+    void minimizeDirectives(const char *data, unsigned long size, std::string &out);
+
+    /*
+     * Files minimized to their directives, by path. Scanning for
+     * dependencies needs nothing else, and a header is minimized once for
+     * all the translation units that include it. Safe to share between
+     * threads.
+     */
+    class DirectiveCache {
+    public:
+        inline DirectiveCache():
+                mutex(), entries() {}
+
+        /* the minimized file at path, or null if it cannot be read */
+        std::shared_ptr<const std::string> get(const std::string &path);
+    private:
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<const std::string>> entries;
+    };
+
+    /* a file up to this size is read whole and lexed from memory, unless lexing is pipelined */
+#define MEMORY_LEX_MAX_SIZE (64ul << 20)
+    std::shared_ptr<TokenStream> makeTokenizer(std::shared_ptr<std::istream> input, const std::string &file, options_t options);
+    /* the tokens of the file at path, or null if it cannot be opened */
+    std::shared_ptr<TokenStream> openSource(const std::string &path, options_t options);
+
     class MacroStack {
     public:
         inline MacroStack(const std::string &x):
@@ -624,38 +1594,47 @@ namespace cpp {
 
     class MacroProcessor: public TokenStream {
     public:
-        inline MacroProcessor(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s):
-        TokenStream(), _input(i), _macroTable(t), _stack(s) {};
+        inline MacroProcessor(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s, options_t o = options_t()):
+        TokenStream(), _input(i), _macroTable(t), _stack(s), _options(o? o: std::make_shared<Options>()) {};
 
-        inline std::shared_ptr<TokenStream> input() const {
+        // references, so that reading a token does not touch reference counts
+        inline const std::shared_ptr<TokenStream> &input() const {
             return _input;
         }
 
-        inline macro_table_t macroTable() const {
+        inline const macro_table_t &macroTable() const {
             return _macroTable;
         }
 
-        inline std::shared_ptr<MacroStack> stack() const {
+        inline const std::shared_ptr<MacroStack> &stack() const {
             return _stack;
         }
 
+        inline const options_t &options() const {
+            return _options;
+        }
+
         inline std::shared_ptr<MacroExpander> makeExpander(std::shared_ptr<TokenStream> input) {
-            return std::make_shared<MacroExpander>(input, _macroTable, _stack);
+            return std::make_shared<MacroExpander>(input, _macroTable, _stack, _options);
         }
 
         inline std::shared_ptr<MacroExpander> makeExpander(std::deque<token_t> tokens) {
             return makeExpander(std::make_shared<TokenStream>(tokens));
         }
+    protected:
+        inline void setInput(std::shared_ptr<TokenStream> input) {
+            _input = input;
+        }
     private:
         std::shared_ptr<TokenStream> _input;
         macro_table_t _macroTable;
         std::shared_ptr<MacroStack> _stack;
+        options_t _options;
     };
 
     class MacroExpander: public MacroProcessor {
     public:
-        inline MacroExpander(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s):
-                MacroProcessor(i, t, s), expander() {}
+        MacroExpander(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s, options_t o = options_t());
 
         virtual bool _finished() const {
             return input()->finished() &&
@@ -668,56 +1647,119 @@ namespace cpp {
 
         virtual token_t _next();
         token_t __next(bool enableMacro = true);
-    private:
+
+        virtual unsigned long _nextBatch(token_t *out, unsigned long n) {
+            return nextBatchAs<MacroExpander>(out, n);
+        }
+    protected:
         token_t expandMacro(token_t name);
+    private:
         token_t expandObjectMacro(const Macro& macro);
         token_t expandFunctionMacro(token_t name, const FunctionMacro &macro);
 
         std::shared_ptr<std::deque<token_t>> scanArg(std::shared_ptr<std::deque<token_t>> curArg);
-        std::deque<token_t> subBody(const FunctionMacro &macro, const std::vector<std::shared_ptr<std::deque<token_t>>> &args);
-
+        std::deque<token_t> subBody(const Macro &macro, const std::vector<std::shared_ptr<std::deque<token_t>>> &args,
+                                    const std::vector<bool> &spaced);
+        token_t paste(token_t lhs, token_t rhs);
+        void expandBody(const Macro &macro, const std::vector<std::shared_ptr<std::deque<token_t>>> &args,
+                        const std::vector<bool> &spaced);
+
+        /* the input, a DirectiveParser unless expanding arguments or conditions */
+        StageInput<DirectiveParser> source;
         std::shared_ptr<TokenStream> expander;
+        /* an expanded macro name had a leading space, which goes on the next token */
+        bool pendingSpace;
     };
 
-#define MAX_INCLUDE_RECURSION 15
-    class DirectiveParser: public MacroProcessor {
+    /* the state of a file whose #include is being read */
+    class IncludeFrame {
     public:
-        inline DirectiveParser(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s, const std::string &f, int d):
-                MacroProcessor(i, t, s), recursionDepth(d), _file(f), ifStack(), lineStart(true), included() {}
+        std::shared_ptr<TokenStream> input;
+        std::string file;
+        std::vector<int> ifStack;
+        bool lineStart;
+        unsigned long emitted;
+        long pathIndex;
+    };
+
+    /*
+     * Handles the directives of a file and of everything it includes. An
+     * #include pushes the including file onto a stack and switches to the
+     * included one, so tokens come out of one loop whatever the depth,
+     * and are expanded once by the MacroExpander reading from here.
+     */
+    class DirectiveParser final: public MacroProcessor {
+    public:
+        inline DirectiveParser(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s, const std::string &f, int d, options_t o = options_t()):
+                MacroProcessor(i, t, s, o), source(), recursionDepth(d), _file(f), ifStack(), lineStart(true),
+                emitted(0), pathIndex(-1), frames() {
+            source.reset(i.get());
+        }
 
         virtual bool _finished() const {
-            return input()->finished() &&
-                    (!included || included->finished());
+            if (!input()->finished())
+                return false;
+            for (const auto &frame: frames) {
+                if (!frame.input->finished())
+                    return false;
+            }
+            return true;
         }
 
         virtual PosInfo _getPos() const {
-            return included? included->getPos(): input()->getPos();
+            return input()->getPos();
         }
 
         std::string file() const {
             return _file;
         }
 
+        /* how many files deep the current one is included */
+        inline int depth() const {
+            return recursionDepth + (int) frames.size();
+        }
+
         virtual token_t _next();
 
-        token_t parseDefine();
-        token_t parseUndef();
+        virtual unsigned long _nextBatch(token_t *out, unsigned long n) {
+            return nextBatchAs<DirectiveParser>(out, n);
+        }
+
+        token_t parseDefine(const PosInfo &pos);
+        token_t parseUndef(const PosInfo &pos);
         token_t parseIf(bool defined, bool neg = false);
         token_t parseElif(const PosInfo &pos);
         token_t parseElse(const PosInfo &pos);
         token_t parseEndif(const PosInfo &pos);
 
-        token_t parseInclude(const PosInfo &pos);
-        token_t include(const std::string &path, const PosInfo &pos, token_t space, bool isQuote);
+        token_t parseInclude(const PosInfo &pos, bool next = false);
+        token_t parsePragma(const PosInfo &pos);
+        token_t parseError(const PosInfo &pos);
+        /* next is #include_next, which searches the include paths after the current file's */
+        token_t include(const std::string &path, const PosInfo &pos, token_t space, bool isQuote, bool next = false);
 
         std::deque<token_t> readLine(bool allowVAARGS = false);
         token_t skipLine();
     private:
+        token_t nextInFile();
+        void define(std::shared_ptr<Macro> macro, const PosInfo &pos);
+
+        inline void setInput(std::shared_ptr<TokenStream> input) {
+            source.reset(input.get());
+            MacroProcessor::setInput(input);
+        }
+
+        /* the current file, usually a Tokenizer */
+        StageInput<Tokenizer> source;
         int recursionDepth;
         std::string _file;
         std::vector<int> ifStack;
         bool lineStart;
-        std::shared_ptr<TokenStream> included;
+        /* tokens passed on from the current file */
+        unsigned long emitted;
+        /* the include path the current file was found in, or -1 */
+        long pathIndex;
+        std::vector<IncludeFrame> frames;
     };
 
     class MacroValue {
@@ -800,29 +1842,614 @@ namespace cpp {
 
     class ConditionParser: public MacroExpander {
     public:
-        inline ConditionParser(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s):
-                MacroExpander(i, t, s) {}
-
-        MacroValue parsePrimary();
-        MacroValue parseUnary();
-        MacroValue parseMultiply();
-        MacroValue parseAdd();
-        MacroValue parseShift();
-        MacroValue parseRelation();
-        MacroValue parseEquality();
-        MacroValue parseBitwiseAnd();
-        MacroValue parseXor();
-        MacroValue parseBitwiseOr();
-        MacroValue parseAnd();
-        MacroValue parseOr();
-        MacroValue parseConditional();
+        inline ConditionParser(std::shared_ptr<TokenStream> i, macro_table_t t, std::shared_ptr<MacroStack> s, options_t o = options_t()):
+                MacroExpander(i, t, s, o), lookahead(), last() {}
+
+        /*
+         * Operands that are not evaluated, like the right side of a false &&,
+         * are parsed with eval false: their macros are still expanded and
+         * their syntax checked, but nothing is computed or diagnosed.
+         */
+        MacroValue parsePrimary(bool eval);
+        MacroValue parseUnary(bool eval);
+        MacroValue parseBinary(int precedence, bool eval);
+        MacroValue parseConditional(bool eval);
+        MacroValue parseComma(bool eval);
         MacroValue parse();
+    private:
+        /* expand is false only for the operand of defined */
+        token_t peek(bool expand = true);
+        token_t fetch(bool expand = true);
+        void skipArguments();
+        PosInfo errorPos() const;
+
+        token_t lookahead;
+        token_t last;
     };
 
-    inline MacroValue parseCondition(const std::deque<token_t> &tokens, macro_table_t table, std::shared_ptr<MacroStack> stack) {
-        ConditionParser cp(std::make_shared<TokenStream>(tokens), table, stack);
+    inline MacroValue parseCondition(const std::deque<token_t> &tokens, macro_table_t table, std::shared_ptr<MacroStack> stack, options_t options = options_t()) {
+        ConditionParser cp(std::make_shared<TokenStream>(tokens), table, stack, options);
         return cp.parse();
     }
+
+    /* notified of what happens while preprocessing; every hook defaults to doing nothing */
+    class PreprocessorCallbacks {
+    public:
+        virtual ~PreprocessorCallbacks() {}
+
+        virtual void includeEnter(const std::string &/* file */, const PosInfo &/* from */) {}
+        /* an included file has been read to the end, right before includeExit */
+        virtual void includeLexed(const std::string &/* file */, unsigned long /* bytes */, unsigned long /* tokens */) {}
+        virtual void includeExit(const std::string &/* file */) {}
+        virtual void macroDefined(const Macro &/* macro */, const PosInfo &/* pos */) {}
+        virtual void macroUndefined(const std::string &/* name */, const PosInfo &/* pos */) {}
+        virtual void macroExpanded(const Macro &/* macro */, const PosInfo &/* pos */) {}
+    };
+
+    /* the files entered through #include, each once, in the order first seen */
+    class IncludeRecorder: public PreprocessorCallbacks {
+    public:
+        virtual void includeEnter(const std::string &file, const PosInfo &/* from */) {
+            if (seen.insert(file).second)
+                files.push_back(file);
+        }
+
+        inline void clear() {
+            files.clear();
+            seen.clear();
+        }
+
+        std::vector<std::string> files;
+    private:
+        std::set<std::string> seen;
+    };
+
+    /* hands every event to each of a list of callbacks */
+    class CallbackList: public PreprocessorCallbacks {
+    public:
+        virtual void includeEnter(const std::string &file, const PosInfo &from) {
+            for (const auto &c: callbacks)
+                c->includeEnter(file, from);
+        }
+
+        virtual void includeLexed(const std::string &file, unsigned long bytes, unsigned long tokens) {
+            for (const auto &c: callbacks)
+                c->includeLexed(file, bytes, tokens);
+        }
+
+        virtual void includeExit(const std::string &file) {
+            for (const auto &c: callbacks)
+                c->includeExit(file);
+        }
+
+        virtual void macroDefined(const Macro &macro, const PosInfo &pos) {
+            for (const auto &c: callbacks)
+                c->macroDefined(macro, pos);
+        }
+
+        virtual void macroUndefined(const std::string &name, const PosInfo &pos) {
+            for (const auto &c: callbacks)
+                c->macroUndefined(name, pos);
+        }
+
+        virtual void macroExpanded(const Macro &macro, const PosInfo &pos) {
+            for (const auto &c: callbacks)
+                c->macroExpanded(macro, pos);
+        }
+
+        std::vector<std::shared_ptr<PreprocessorCallbacks>> callbacks;
+    };
+
+    /*
+     * Times every include and counts the bytes lexed, tokens passed on,
+     * macros defined and expansions done in it, for a trace in the Chrome
+     * trace event format (chrome://tracing, Perfetto). Totals per header
+     * are kept across all the translation units traced.
+     */
+    class IncludeTracer: public PreprocessorCallbacks {
+    public:
+        IncludeTracer();
+
+        /* brackets a translation unit, which its includes are nested in */
+        void beginFile(const std::string &file);
+        void endFile();
+
+        virtual void includeEnter(const std::string &file, const PosInfo &from);
+        virtual void includeLexed(const std::string &file, unsigned long bytes, unsigned long tokens);
+        virtual void includeExit(const std::string &file);
+        virtual void macroDefined(const Macro &macro, const PosInfo &pos);
+        virtual void macroExpanded(const Macro &macro, const PosInfo &pos);
+
+        void writeTrace(std::ostream &os) const;
+        /* the totals per header, each without its nested includes, the most expensive first */
+        void writeSummary(std::ostream &os) const;
+    private:
+        class Counts {
+        public:
+            inline Counts(): bytes(0), tokens(0), macros(0), expansions(0) {}
+
+            unsigned long bytes, tokens, macros, expansions;
+        };
+
+        class Event {
+        public:
+            std::string file;
+            bool include;
+            /* microseconds since the tracer was made */
+            double start, duration;
+            /* the part of duration spent in nested includes */
+            double nested;
+            Counts counts;
+        };
+
+        class Total {
+        public:
+            inline Total(): count(0), time(0), counts() {}
+
+            unsigned long count;
+            /* not counting nested includes, like the counts */
+            double time;
+            Counts counts;
+        };
+
+        double now() const;
+        void push(const std::string &file, bool include);
+        void pop();
+
+        std::chrono::steady_clock::time_point origin;
+        /* the files being read, innermost last */
+        std::vector<Event> stack;
+        std::vector<Event> events;
+        std::map<std::string, Total> totals;
+    };
+
+    /* an output token; spelling and pos stay valid until TokenSink::tokens returns */
+    class TokenRecord {
+    public:
+        Token::token_type kind;
+        /* a space has to be written before the spelling */
+        bool leadingSpace;
+        const char *spelling;
+        unsigned long size;
+        const PosInfo *pos;
+    };
+
+    class TokenSink {
+    public:
+        virtual ~TokenSink() {}
+
+        virtual void tokens(const TokenRecord *records, unsigned long count) = 0;
+    };
+
+    /* writes the spelling of every token */
+    class TextSink: public TokenSink {
+    public:
+        inline TextSink(std::ostream &o):
+                os(o) {}
+
+        virtual void tokens(const TokenRecord *records, unsigned long count) {
+            for (unsigned long i = 0; i<count; i++) {
+                if (records[i].leadingSpace)
+                    os.put(' ');
+                os.write(records[i].spelling, records[i].size);
+            }
+        }
+    private:
+        std::ostream &os;
+    };
+
+    /* drops every token, for runs made for their callbacks or their timing */
+    class NullSink: public TokenSink {
+    public:
+        virtual void tokens(const TokenRecord */* records */, unsigned long /* count */) {}
+    };
+
+    /*
+     * Writes tokens with as little whitespace as still lexes the same: a
+     * space only where two tokens would run together and one line break
+     * per line that has tokens. With markers, a "# line "file"" line is
+     * written wherever the lines stop following the source.
+     */
+    class CompactSink: public TokenSink {
+    public:
+        CompactSink(std::ostream &o, bool m = false);
+
+        virtual void tokens(const TokenRecord *records, unsigned long count);
+
+        /* ends the last line; what comes next is marked as a new file */
+        void finish();
+    private:
+        void startLine(const TokenRecord &record);
+
+        std::ostream &os;
+        bool markers;
+        /* the last token on the line, empty at the start of a line */
+        const char *prev;
+        unsigned long prevSize;
+        Token::token_type prevKind;
+        /* holds prev once its batch is gone */
+        std::string prevCopy;
+        bool lineBreak;
+        /* where the next line comes from, and where the last line written came from */
+        std::string file, lastFile;
+        int line, lastLine;
+    };
+
+    class Sha256 {
+    public:
+        Sha256();
+
+        void update(const char *data, unsigned long n);
+        /* the digest in hex; nothing can be added after this */
+        std::string finish();
+    private:
+        void block(const unsigned char *p);
+
+        uint32_t state[8];
+        unsigned char buffer[64];
+        unsigned long used;
+        unsigned long long length;
+    };
+
+    std::string sha256(const char *data, unsigned long n);
+
+    /* the SHA-256 of a file's contents, or "" if it cannot be read */
+    std::string hashFile(const std::string &path);
+
+    /*
+     * Hashes everything written through it on its way to another stream,
+     * or to nowhere if that is null, so output is hashed as it streams.
+     */
+    class HashingBuffer: public std::streambuf {
+    public:
+        HashingBuffer(std::ostream *o);
+
+        /* the hash of everything written */
+        std::string finish();
+    protected:
+        virtual int_type overflow(int_type c);
+        virtual int sync();
+    private:
+        bool drain();
+
+        std::ostream *os;
+        Sha256 hash;
+        char chunk[1 << 12];
+    };
+
+    class HashingStream: public std::ostream {
+    public:
+        inline HashingStream(std::ostream *o):
+                std::ostream(nullptr), buffer(o) {
+            rdbuf(&buffer);
+        }
+
+        inline std::string finish() {
+            return buffer.finish();
+        }
+    private:
+        HashingBuffer buffer;
+    };
+
+    /* writes data to path through a temporary, so readers never see half a file */
+    bool replaceFile(const std::string &path, const std::string &data);
+
+    /*
+     * Direct mode caching: for an input and the flags it was preprocessed
+     * with, remembers the files it included with their hashes and the
+     * hash of the output. While none of them changes the output can be
+     * had without preprocessing.
+     */
+    class ManifestCache {
+    public:
+        ManifestCache(const std::string &d);
+
+        /* what input and flags are cached under, or "" if input cannot be read */
+        std::string key(const std::string &input, const std::string &flags) const;
+
+        /* the hash of the output cached under key if it is still valid, or "" */
+        std::string lookup(const std::string &key) const;
+
+        bool load(const std::string &hash, std::string &output) const;
+        bool store(const std::string &key, const std::vector<std::string> &includes,
+                   const std::string &output, const std::string &hash);
+    private:
+        std::string dir;
+    };
+
+#define PREPROCESSOR_BATCH_SIZE TOKEN_BATCH_SIZE
+    /*
+     * The library entry point: include paths, predefined macros and an
+     * input go in, tokens come out in batches.
+     *
+     *     Preprocessor pp;
+     *     pp.addIncludePath("include");
+     *     pp.define("NDEBUG");
+     *     pp.setInput("main.c");
+     *     pp.run(sink);
+     */
+    class Preprocessor {
+    public:
+        Preprocessor(options_t o = options_t());
+
+        inline options_t options() const {
+            return _options;
+        }
+
+        inline macro_table_t macroTable() const {
+            return _macroTable;
+        }
+
+        void addIncludePath(const std::string &path);
+        void define(const std::string &name, const std::string &value = "1");
+        void undef(const std::string &name);
+        /* read before the input, after the macros above; only its macros are kept, like -imacros */
+        void addForcedInclude(const std::string &path);
+        void setCallbacks(std::shared_ptr<PreprocessorCallbacks> callbacks);
+
+        /* applies the predefined macros and forced includes now instead of in run */
+        void prepare();
+        /*
+         * A preprocessor with the same options, starting from the macros
+         * this one has after prepare. Cheap enough to do once per
+         * translation unit, see MacroTable::fork.
+         */
+        std::shared_ptr<Preprocessor> fork();
+        /* the same with other options, such as callbacks of its own */
+        std::shared_ptr<Preprocessor> fork(options_t options);
+
+        void setInput(const std::string &file);
+        void setInput(std::shared_ptr<std::istream> input, const std::string &file);
+
+        /*
+         * Preprocesses the input, starting from the prepared macros. The
+         * peak of options()->memory, if any, is measured from here.
+         * Returns false if the input cannot be opened; parsing errors are
+         * thrown after every token before them has been delivered.
+         */
+        bool run(TokenSink &sink);
+        /*
+         * Processes only the directives of the input and its includes,
+         * for the macros they leave in macroTable(); text lines are
+         * skipped without being expanded. Returns false if the input
+         * cannot be opened.
+         */
+        bool runDirectives();
+    private:
+        options_t _options;
+        macro_table_t _macroTable;
+        std::string predefined;
+        std::string file;
+        std::shared_ptr<std::istream> input;
+    };
+
+    /* writes the visible macros sorted by name, as #define lines like gcc -dM */
+    void writeDefines(std::ostream &os, const MacroTable &table);
+
+    /*
+     * Binary token streams, for consumers that would rather not lex the
+     * text output again. A stream is laid out as
+     *
+     *     header        "CPPTOKS" 1, u32 flags, u32 strings, u64 records, u64 string bytes
+     *     offsets       u32 per string plus one, where each spelling starts
+     *     string data   the interned spellings, back to back
+     *     records       varint tag, varint spelling id, then with
+     *                   BINARY_LOCATIONS [varint file id] zigzag line delta, varint col
+     *
+     * with little endian integers. A tag is kind | newLine << 3 |
+     * leadingSpace << 4 | fileChanged << 5. Whitespace is not stored as
+     * records but folded into the flags of the token after it.
+     */
+#define BINARY_MAGIC "CPPTOKS\1"
+#define BINARY_HEADER_SIZE 32
+#define BINARY_LOCATIONS 1u
+
+    class BinaryTokenWriter: public TokenSink {
+    public:
+        BinaryTokenWriter(std::ostream &o, bool locations = false);
+
+        virtual void tokens(const TokenRecord *records, unsigned long count);
+        /* writes the stream; nothing reaches the output before this */
+        void finish();
+    private:
+        unsigned long intern(const char *s, unsigned long n);
+
+        std::ostream &os;
+        bool locations;
+        bool newLine, leadingSpace;
+        unsigned long file;
+        int line;
+        unsigned long recordCount;
+        std::unordered_map<std::string, unsigned long> ids;
+        std::vector<unsigned long> offsets;
+        std::string strings;
+        std::string records;
+    };
+
+    /* one record, pointing into the mapped stream */
+    class BinaryToken {
+    public:
+        Token::token_type kind;
+        const char *spelling;
+        unsigned long size;
+        bool newLine, leadingSpace;
+        /* only with BINARY_LOCATIONS */
+        const char *file;
+        unsigned long fileSize;
+        int line, col;
+    };
+
+    /* walks a binary token stream in place, without copying or allocating */
+    class BinaryTokenReader {
+    public:
+        /* throws ParsingException if data does not hold a whole stream */
+        BinaryTokenReader(const char *data, unsigned long size);
+
+        inline bool hasLocations() const {
+            return flags & BINARY_LOCATIONS;
+        }
+
+        inline unsigned long stringCount() const {
+            return _stringCount;
+        }
+
+        inline unsigned long recordCount() const {
+            return _recordCount;
+        }
+
+        inline void spelling(unsigned long id, const char *&s, unsigned long &n) const {
+            auto begin = offset(id);
+            s = strings + begin;
+            n = offset(id + 1) - begin;
+        }
+
+        bool next(BinaryToken &token);
+        void rewind();
+    private:
+        unsigned long offset(unsigned long id) const;
+        unsigned long varint();
+
+        const char *data, *end, *strings, *records, *cur;
+        unsigned long flags, _stringCount, _recordCount, read;
+        unsigned long file;
+        int line;
+    };
+
+    /* a read-only mapping of a whole file */
+    class MappedFile {
+    public:
+        MappedFile(const std::string &path);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        inline bool isOpen() const {
+            return _data != nullptr;
+        }
+
+        inline const char *data() const {
+            return _data;
+        }
+
+        inline unsigned long size() const {
+            return _size;
+        }
+    private:
+        const char *_data;
+        unsigned long _size;
+    };
+
+    /* a #define, #undef or expansion of a macro, in some translation unit */
+    class MacroUse {
+    public:
+        enum use_type {
+            DEFINE,
+            UNDEF,
+            EXPAND
+        };
+
+        use_type kind;
+        std::string name, file;
+        int line, col;
+    };
+
+    /* the macro uses of one translation unit, collected as callbacks */
+    class MacroUseRecorder: public PreprocessorCallbacks {
+    public:
+        virtual void macroDefined(const Macro &macro, const PosInfo &pos) {
+            add(MacroUse::DEFINE, macro.name(), pos);
+        }
+
+        virtual void macroUndefined(const std::string &name, const PosInfo &pos) {
+            add(MacroUse::UNDEF, name, pos);
+        }
+
+        virtual void macroExpanded(const Macro &macro, const PosInfo &pos) {
+            add(MacroUse::EXPAND, macro.name(), pos);
+        }
+
+        std::vector<MacroUse> uses;
+    private:
+        inline void add(MacroUse::use_type kind, const std::string &name, const PosInfo &pos) {
+            uses.push_back(MacroUse());
+            auto &use = uses.back();
+            use.kind = kind;
+            use.name = name;
+            use.file = pos.file;
+            use.line = pos.line;
+            use.col = pos.col;
+        }
+    };
+
+    /*
+     * An index of where macros are defined, undefined and expanded, so
+     * that finding them does not take preprocessing again. It is laid
+     * out as
+     *
+     *     header    "CPPMIDX" 1, u32 names, u32 strings, u64 entries, u64 string bytes
+     *     names     u32 string id, u32 first entry, u32 entry count per macro, sorted by name
+     *     offsets   u32 per string plus one, where each string starts
+     *     strings   macro names, files and translation units, back to back
+     *     entries   u32 kind, u32 file id, u32 line, u32 col, u32 unit id, by macro
+     *
+     * with little endian integers, and is searched in place once mapped.
+     */
+#define INDEX_MAGIC "CPPMIDX\1"
+#define INDEX_HEADER_SIZE 32
+#define INDEX_NAME_SIZE 12
+#define INDEX_ENTRY_SIZE 20
+
+    /* one entry, pointing into the mapped index */
+    class MacroIndexEntry {
+    public:
+        MacroUse::use_type kind;
+        const char *file;
+        unsigned long fileSize;
+        int line, col;
+        const char *unit;
+        unsigned long unitSize;
+    };
+
+    class MacroIndexReader {
+    public:
+        /* throws ParsingException if data does not hold a whole index */
+        MacroIndexReader(const char *data, unsigned long size);
+
+        inline unsigned long nameCount() const {
+            return _nameCount;
+        }
+
+        /* the macro with the ith smallest name, and where its entries are */
+        void name(unsigned long i, const char *&s, unsigned long &n, unsigned long &first, unsigned long &count) const;
+
+        /* where the entries of a macro are, by binary search; false if it has none */
+        bool find(const std::string &name, unsigned long &first, unsigned long &count) const;
+
+        void entry(unsigned long i, MacroIndexEntry &entry) const;
+    private:
+        void string(unsigned long id, const char *&s, unsigned long &n) const;
+
+        const char *data, *names, *offsets, *strings, *entries;
+        unsigned long _nameCount, stringCount, entryCount;
+    };
+
+    /*
+     * Builds an index one translation unit at a time, possibly on top of
+     * an older one, so only the units that changed need preprocessing.
+     */
+    class MacroIndexWriter {
+    public:
+        /* adds the units of an existing index that have not been updated here */
+        void load(const MacroIndexReader &reader);
+
+        /* replaces what is known about unit; units may be updated from several threads */
+        void update(const std::string &unit, std::vector<MacroUse> &&uses);
+
+        void write(std::ostream &os) const;
+    private:
+        mutable std::mutex mutex;
+        std::map<std::string, std::vector<MacroUse>> units;
+    };
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include "preprocessor.h"
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace cpp {
+    namespace {
+        /* the first backslash in [p, e), or question mark if trigraphs are on, or e */
+        inline const char *findCandidate(const char *p, const char *e, bool trigraphs) {
+#if defined(__SSE2__)
+            const __m128i b = _mm_set1_epi8('\\'), q = _mm_set1_epi8(trigraphs? '?': '\\');
+            for (; e - p >= 16; p += 16) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, b), _mm_cmpeq_epi8(v, q)));
+                if (mask)
+                    return p + __builtin_ctz(mask);
+            }
+#endif
+            for (; p < e; p++) {
+                if (*p == '\\' || (trigraphs && *p == '?'))
+                    return p;
+            }
+            return e;
+        }
+
+        /* what ??c stands for, or 0 */
+        inline char trigraph(char c) {
+            switch (c) {
+                case '=': return '#';
+                case '/': return '\\';
+                case '\'': return '^';
+                case '(': return '[';
+                case ')': return ']';
+                case '!': return '|';
+                case '<': return '{';
+                case '>': return '}';
+                case '-': return '~';
+                default: return 0;
+            }
+        }
+
+        /* the length of the line break at p, or 0 */
+        inline unsigned long lineBreak(const char *p, const char *e) {
+            if (p < e && *p == '\n')
+                return 1;
+            if (p < e && *p == '\r')
+                return p + 1 < e && p[1] == '\n'? 2: 1;
+            return 0;
+        }
+    }
+
+    PosInfo SourceMap::physical(const PosInfo &logical) const {
+        auto it = std::upper_bound(edits.begin(), edits.end(), logical.pos,
+                                   [](unsigned long pos, const Edit &edit) { return pos < edit.end; });
+        if (it == edits.begin())
+            return logical;
+        --it;
+        PosInfo result(logical);
+        result.line += it->lines;
+        result.pos = it->physical + (logical.pos - it->end);
+        // the column only moves if the edit is on the same logical line
+        if (it->end + logical.col >= logical.pos)
+            result.col = it->col + (int) (logical.pos - it->end);
+        return result;
+    }
+
+    std::string SourceMap::original(const char *b, const char *e, unsigned long offset) const {
+        auto end = offset + (e - b);
+        auto it = std::lower_bound(edits.begin(), edits.end(), offset,
+                                   [](const Edit &edit, unsigned long pos) { return edit.begin < pos; });
+        std::string result;
+        for (; it != edits.end() && it->end <= end; ++it) {
+            result.append(b, it->begin - offset);
+            result += it->original;
+            b += it->end - offset;
+            offset = it->end;
+        }
+        result.append(b, e);
+        return result;
+    }
+
+    bool spliceLines(const char *data, unsigned long size, bool trigraphs, std::string &logical, SourceMap &map) {
+        const char *e = data + size, *copied = data, *p = data;
+        int lines = 0;
+        while ((p = findCandidate(p, e, trigraphs)) < e) {
+            const char *q = p;
+            char c = *p;
+            if (c == '?') {
+                c = p + 2 < e && p[1] == '?'? trigraph(p[2]): 0;
+                if (!c) {
+                    p++;
+                    continue;
+                }
+                q = p + 2;
+            }
+            auto n = c == '\\'? lineBreak(q + 1, e): 0;
+            if (c == '\\' && q == p && !n) {
+                p++;
+                continue;
+            }
+
+            if (logical.empty() && map.empty())
+                logical.reserve(size);
+            logical.append(copied, p);
+            SourceMap::Edit edit;
+            edit.begin = logical.size();
+            copied = n? q + 1 + n: q + 1;
+            if (n) {
+                lines++;
+                edit.col = 0;
+            } else {
+                logical.push_back(c);
+                // the column after the trigraph: back to the last line break or edit
+                const char *r = p;
+                auto floor = map.empty()? data: data + map.edits.back().physical;
+                while (r > floor && r[-1] != '\n' && r[-1] != '\r')
+                    r--;
+                if (r == floor && !map.empty() && floor > data && floor[-1] != '\n' && floor[-1] != '\r')
+                    edit.col = map.edits.back().col + (int) (copied - floor);
+                else
+                    edit.col = (int) (copied - r);
+            }
+            edit.end = logical.size();
+            edit.physical = copied - data;
+            edit.lines = lines;
+            edit.original.assign(p, copied);
+            map.edits.push_back(edit);
+            p = copied;
+        }
+        if (map.empty())
+            return false;
+        logical.append(copied, e);
+        return true;
+    }
+}
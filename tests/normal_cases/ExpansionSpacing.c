@@ -0,0 +1,22 @@
+#define E
+#define ID(x) x
+#define S(x) #x
+#define XS(x) S(x)
+#define V(...) __VA_ARGS__ | #__VA_ARGS__
+#define P(a, b) a ## b
+#define TWO a  b
+#define F(x, y) ( x ) y
+#define G F(1 , TWO) E + ID( q   r )
+(E) a E b (ID( 1 )) [TWO]
+G
+XS(G)
+XS( ID(a  b) + TWO )
+V(a ,b,  c)
+V(TWO, ID(TWO) ,E)
+P(x, y) P( TWO , E)
+F(E,E)F(TWO,)
+ID(ID(ID(E a E)))
+XS(ID(E x E))
+#define H(x) x E x
+H(H(1))
+XS(H(H(1)))
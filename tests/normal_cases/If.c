@@ -10,3 +10,7 @@
 #else
 #jfekl
 #endif
+#define eq 1
+#if eq
+3
+#endif
@@ -0,0 +1,16 @@
+char *a = "he said \"hi\"\n\x41\101\U0001F600 /* not */ // not";
+char b = '\'', c = '\\', x = '\x7f';
+char *d = R"xy(raw ) "still" )x" )xy";
+char *e = u8"pre" L'x' U"wide";
+/* multi
+   line */ int f; // tail
+char *g = "spl\
+iced";
+/* spl *\
+/ int h;
+char *i = R"(line1
+line2)";
+
+int j; // comment \
+int hidden;
+int k;
\ No newline at end of file
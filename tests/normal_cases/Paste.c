@@ -0,0 +1,27 @@
+#define str(x) #x
+#define xstr(x) str(x)
+#define cat(a, b) a ## b
+#define xcat(a, b) cat(a, b)
+#define foo 4
+str(foo)
+xstr(foo)
+str( a  +   b /* c */ - "q\n" 'x' )
+str()
+cat(x, y)
+cat(x, )
+cat(, y)
+cat(1, 2)
+cat(+, =)
+cat(<, <=)
+cat(L, "wide")
+xcat(xcat(1, 2), 3)
+cat(fo, o)
+#define obj a ## b
+obj
+#define showlist(...) #__VA_ARGS__
+showlist(The first, second,and third items.)
+#define hash_hash # ## #
+#define mkstr(a) # a
+#define in_between(a) mkstr(a)
+#define join(c, d) in_between(c hash_hash d)
+join(x, y)
@@ -0,0 +1,31 @@
+#define F(x) x
+#if 0 && UNDEFINED_FN(1, 2)
+bad1
+#endif
+#if 1 || 1 / 0
+good1
+#endif
+#if 0 ? 1 / 0 : 2 + 3 * 4 == 14
+good2
+#endif
+#if (1 + 2) * 3 == 9 && F(3) >= 3 && 10 % 4 == 2 && (2 bitor 1) == 3 && not 0
+good3
+#endif
+#define OP +
+#if 0 && 1 OP 2
+bad2
+#endif
+#if 0 && (1 OP 2)
+good4
+#else
+good5
+#endif
+#if 0 ? X OP 1 : 2
+good6
+#endif
+#if 1 ? 2 , 3 : 4
+good7
+#endif
+#if 0 && 1 / 0
+bad3
+#endif
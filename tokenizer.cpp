@@ -1,7 +1,13 @@
+#include <algorithm>
 #include <sstream>
 #include "preprocessor.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace cpp {
+    PosInfo posStart("");
+
     char PP_PUNCS[PP_PUNCS_COUNT][4] = {
         "->*", "%:%", "...", ">>=", "<<=", "##", "<:", ":>",
         "<%", "%>", "%:", "::", ".*", "+=", "-=", "*=", "/=",
@@ -12,30 +18,31 @@ namespace cpp {
     };
 
     void Tokenizer::spliceLine() {
-        auto _pos(pos);
-        if (input->peek() == '\\') {
+        // splices can follow each other, like the prepass removes them
+        while (input->peek() == '\\') {
+            auto _pos(pos);
             advanceRaw();
             int c = input->peek();
+            // advanceRaw counts the line break, and \r\n once
             if (c == '\r') {
                 advanceRaw();
-                pos.newLine();
-                if (input->peek() == '\n') {
-                    input->ignore();
+                if (input->peek() == '\n')
                     advanceRaw();
-                }
             } else if (c == '\n') {
                 advanceRaw();
-                pos.newLine();
             } else {
                 pos = _pos;
                 input->unget();
                 input->clear();
+                break;
             }
         }
     }
 
     void Tokenizer::advanceRaw() {
         int c = input->get();
+        if (c == EOF)
+            return;
         if (c == '\r') {
             hasReturn = true;
             pos.newLine();
@@ -72,10 +79,13 @@ namespace cpp {
         bool hasNewLine = false;
         while (!input->eof()) {
             int c;
-            if (match("/*", false)) {
+            if (scanComment()) {
+                tokenBuffer << ' ';
+            } else if (match("/*", false)) {
                 tokenBuffer << ' ';
                 while (!match("*/", false)) {
-                    if (input->eof()) {
+                    // match() clears eof when it backs off, so look for the end itself
+                    if (input->peek() == EOF) {
                         throw ParsingException("Unterminated comment", pos);
                     }
                     advance();
@@ -132,7 +142,7 @@ namespace cpp {
             } else {
                 input->clear();
                 input->seekg(p);
-                pos = startPos;
+                restartToken();
                 return parsePunc();
             }
         } else if (isdigit(c)) {
@@ -210,6 +220,7 @@ namespace cpp {
                 do {
                     advance();
                     tokenBuffer << (char) c;
+                    c = input->peek();
                 } while (isHexDigit(c));
             } else {
                 unexpected((char) c, pos);
@@ -227,6 +238,8 @@ namespace cpp {
     }
 
     token_t Tokenizer::parseCharSequence(char quote, Token::token_type type) {
+        if (auto token = scanCharSequence(quote, type))
+            return token;
         if (!match(quote))
             throw ParsingException("Expected " + quote, pos);
         while (!input->eof()) {
@@ -245,6 +258,8 @@ namespace cpp {
     }
 
     token_t Tokenizer::parseRawString() {
+        if (auto token = scanRawString())
+            return token;
         int c;
         std::stringstream ss;
         if (!matchRaw('\"', true))
@@ -278,7 +293,221 @@ namespace cpp {
         throw ParsingException("Unterminated raw string", pos);
     }
 
+    namespace {
+        /* the first quote, backslash or line break in [p, e), or e */
+        inline const char *findSpecial(const char *p, const char *e, char quote) {
+#if defined(__SSE2__)
+            const __m128i q = _mm_set1_epi8(quote), b = _mm_set1_epi8('\\'),
+                          n = _mm_set1_epi8('\n'), r = _mm_set1_epi8('\r');
+            for (; e - p >= 16; p += 16) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, b)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, n), _mm_cmpeq_epi8(v, r)));
+                int mask = _mm_movemask_epi8(m);
+                if (mask)
+                    return p + __builtin_ctz(mask);
+            }
+#endif
+            for (; p < e; p++) {
+                if (*p == quote || *p == '\\' || *p == '\n' || *p == '\r')
+                    return p;
+            }
+            return e;
+        }
+
+        inline bool isLineBreak(const char *p, const char *e) {
+            return p < e && (*p == '\n' || *p == '\r');
+        }
+
+        inline unsigned long hexDigits(const char *p, const char *e, unsigned long max) {
+            unsigned long n = 0;
+            while (n < max && p + n < e && isHexDigit(p[n]))
+                n++;
+            return n;
+        }
+
+        /* the length of the escape after a backslash at p, as parseEscape reads it, or 0 */
+        unsigned long escapeLength(const char *p, const char *e) {
+            if (p == e || isLineBreak(p, e))
+                return 0;
+            switch (*p) {
+                case '\\':
+                    // a backslash before a line break splices instead
+                    return isLineBreak(p + 1, e)? 0: 1;
+                case '\'': case '"': case '?': case 'a': case 'b':
+                case 'f': case 'n': case 'r': case 't': case 'v':
+                    return 1;
+                case 'u':
+                    return hexDigits(p + 1, e, 4) == 4? 5: 0;
+                case 'U':
+                    return hexDigits(p + 1, e, 8) == 8? 9: 0;
+                case 'x': {
+                    auto n = hexDigits(p + 1, e, (unsigned long) -1);
+                    return n? n + 1: 0;
+                }
+                default: {
+                    unsigned long n = 0;
+                    while (n < 3 && p + n < e && *(p + n) >= '0' && *(p + n) <= '7')
+                        n++;
+                    return n;
+                }
+            }
+        }
+
+        /* whether a line splice starts anywhere in [p, e) */
+        inline bool hasSplice(const char *p, const char *e) {
+            while ((p = static_cast<const char*>(memchr(p, '\\', e - p)))) {
+                if (isLineBreak(++p, e))
+                    return true;
+            }
+            return false;
+        }
+    }
+
+    void Tokenizer::skipSpan(const char *p, unsigned long n) {
+        // what advanceRaw does for each byte
+        for (unsigned long i = 0; i<n; i++) {
+            if (p[i] == '\r') {
+                hasReturn = true;
+                pos.newLine();
+            } else if (p[i] == '\n') {
+                if (!hasReturn)
+                    pos.newLine();
+                else
+                    hasReturn = false;
+            } else {
+                pos.col++;
+                hasReturn = false;
+            }
+        }
+        pos.pos += n;
+        memory->skip(n);
+    }
+
+    token_t Tokenizer::scanCharSequence(char quote, Token::token_type type) {
+        if (!memory)
+            return token_t();
+        const char *b = memory->current(), *e = memory->end();
+        if (b == e || *b != quote)
+            return token_t();
+        const char *p = b + 1;
+        while (true) {
+            p = findSpecial(p, e, quote);
+            if (p == e || *p == '\n' || *p == '\r')
+                return token_t();
+            if (*p == quote)
+                break;
+            auto n = escapeLength(p + 1, e);
+            if (!n)
+                return token_t();
+            p += n + 1;
+        }
+        p++;
+        std::string value(tokenBuffer.str());
+        value.append(b, p - b);
+        skipSpan(b, p - b);
+        spliceLine();
+        return std::make_shared<Token>(type, value, startPos);
+    }
+
+    token_t Tokenizer::scanRawString() {
+        if (!memory)
+            return token_t();
+        const char *b = memory->current(), *e = memory->end();
+        if (b == e || *b != '"')
+            return token_t();
+        const char *p = b + 1;
+        for (; p < e && *p != '('; p++) {
+            if (strchr(" )\\\t\f\r\n", *p))
+                return token_t();
+        }
+        if (p == e)
+            return token_t();
+        // the body ends at the first )delim"
+        std::string terminator(")");
+        terminator.append(b + 1, p - b - 1);
+        terminator.push_back('"');
+        auto t = terminator.size();
+        for (p++; (p = static_cast<const char*>(memchr(p, ')', e - p))); p++) {
+            if ((unsigned long) (e - p) < t)
+                return token_t();
+            if (memcmp(p, terminator.data(), t) == 0) {
+                p += t;
+                std::string value(tokenBuffer.str());
+                // splices and trigraphs are undone inside raw strings
+                if (sourceMap)
+                    value += sourceMap->original(b, p, pos.pos);
+                else
+                    value.append(b, p - b);
+                skipSpan(b, p - b);
+                return std::make_shared<Token>(Token::STRING, value, startPos);
+            }
+        }
+        return token_t();
+    }
+
+    bool Tokenizer::scanComment() {
+        if (!memory)
+            return false;
+        const char *b = memory->current(), *e = memory->end();
+        if (e - b < 2 || b[0] != '/' || (b[1] != '*' && b[1] != '/'))
+            return false;
+        const char *p = b + 2;
+        if (b[1] == '*') {
+            while ((p = static_cast<const char*>(memchr(p, '*', e - p))) && (p + 1 == e || p[1] != '/'))
+                p++;
+            if (!p)
+                return false;
+            p += 2;
+        } else {
+            while (p < e && *p != '\n' && *p != '\r')
+                p++;
+        }
+        // a backslash before its line break carries a // comment on
+        if (hasSplice(b, p) || (b[1] == '/' && p < e && p[-1] == '\\'))
+            return false;
+        skipSpan(b, p - b);
+        spliceLine();
+        return true;
+    }
+
+    void Tokenizer::_skipText() {
+        if (!memory)
+            return;
+        const char *b = memory->current(), *e = memory->end(), *p = b;
+        // literals, comments and splices can hide or make line breaks
+        for (; p < e; p++) {
+            auto c = *p;
+            if (c == '\n' || c == '\r' || c == '"' || c == '\'' || c == '\\' ||
+                    (c == '/' && p + 1 < e && (p[1] == '*' || p[1] == '/')))
+                break;
+        }
+        // a prefix such as u8R or a digit separator belongs to what follows
+        if (p < e && *p != '\n' && *p != '\r') {
+            while (p > b && (isalnum(p[-1]) || p[-1] == '_' || p[-1] == '.'))
+                p--;
+            // splices are only taken after a byte the lexer advances over
+            if (p > b && *p == '\\')
+                p--;
+        }
+        if (p > b)
+            skipSpan(b, p - b);
+    }
+
     token_t Tokenizer::_next() {
+        if (!sourceMap)
+            return lex();
+        try {
+            return lex();
+        } catch (ParsingException &e) {
+            throw ParsingException(e.message().c_str(), sourceMap->physical(e.position()));
+        }
+    }
+
+    token_t Tokenizer::lex() {
+        // a splice right at the start follows no byte that advance() went over
+        if (pos.pos == 0 && !sourceMap)
+            spliceLine();
         int c = input->peek();
         if (input->eof())
             return token_t();
@@ -307,7 +536,7 @@ namespace cpp {
                     throw ParsingException("Expected \"", pos);
                 return parseCharSequence((char) c, Token::CHARACTER);
             } else {
-                pos = startPos;
+                restartToken();
                 input->clear();
                 input->seekg(p);
                 tokenBuffer.str("");
@@ -322,4 +551,128 @@ namespace cpp {
         }
         return parsePunc();
     }
-}
\ No newline at end of file
+
+    namespace {
+        inline unsigned long matchPunc(const char *s, unsigned long n) {
+            for (int i = 0; i<PP_PUNCS_COUNT; i++) {
+                auto l = strlen(PP_PUNCS[i]);
+                if (l <= n && memcmp(s, PP_PUNCS[i], l) == 0)
+                    return l;
+            }
+            return 1;
+        }
+
+        /* the length of the character sequence starting at the quote s[0], or 0 */
+        unsigned long matchCharSequence(const char *s, unsigned long n) {
+            char quote = s[0];
+            for (unsigned long i = 1; i<n; i++) {
+                if (s[i] == '\\')
+                    i++;
+                else if (s[i] == '\r' || s[i] == '\n')
+                    return 0;
+                else if (s[i] == quote)
+                    return i + 1;
+            }
+            return 0;
+        }
+
+        unsigned long matchRawString(const char *s, unsigned long n) {
+            auto open = static_cast<const char*>(memchr(s, '(', n));
+            if (!open)
+                return 0;
+            auto delim = open - s - 1;
+            for (unsigned long i = open - s + 1; i + delim + 1 < n; i++) {
+                if (s[i] == ')' && memcmp(s + i + 1, s + 1, delim) == 0 && s[i + delim + 1] == '"')
+                    return i + delim + 2;
+            }
+            return 0;
+        }
+    }
+
+    bool isSingleToken(const char *s, unsigned long n, Token::token_type &type) {
+        if (n == 0)
+            return false;
+        unsigned long l = 0;
+        int c = (unsigned char) s[0];
+        if ((c == '.' && n > 1 && isdigit(s[1])) || isdigit(c)) {
+            type = Token::NUMBER;
+            l = c == '.'? 2: 1;
+            while (l < n) {
+                if (s[l] == 'E' || s[l] == 'e') {
+                    l++;
+                    if (l < n && (s[l] == '+' || s[l] == '-'))
+                        l++;
+                } else if (s[l] == '\'' && l + 1 < n && isIdChar(s[l + 1])) {
+                    l += 2;
+                } else if (isIdChar(s[l])) {
+                    l++;
+                } else {
+                    break;
+                }
+            }
+        } else if (isalpha(c) || c == '_') {
+            unsigned long p = 0;
+            bool raw = false;
+            if (c == 'R') {
+                p = 1;
+                raw = true;
+            } else if (c == 'u' || c == 'U' || c == 'L') {
+                p = 1;
+                if (c == 'u' && p < n && s[p] == '8')
+                    p++;
+                if (p < n && s[p] == 'R') {
+                    p++;
+                    raw = true;
+                }
+            }
+            if (p > 0 && p < n && (s[p] == '"' || (s[p] == '\'' && !raw && !(c == 'u' && p == 2)))) {
+                type = s[p] == '"'? Token::STRING: Token::CHARACTER;
+                l = raw? matchRawString(s + p, n - p): matchCharSequence(s + p, n - p);
+                if (l == 0)
+                    return false;
+                l += p;
+            } else {
+                type = Token::IDENTIFIER;
+                while (l < n && isIdChar(s[l]))
+                    l++;
+            }
+        } else if (c == '"' || c == '\'') {
+            type = c == '"'? Token::STRING: Token::CHARACTER;
+            l = matchCharSequence(s, n);
+        } else {
+            type = Token::PUNC;
+            l = matchPunc(s, n);
+        }
+        return l == n;
+    }
+
+    bool wouldPaste(const char *a, unsigned long an, Token::token_type at, const char *b, unsigned long bn) {
+        if (an == 0 || bn == 0)
+            return false;
+        int x = (unsigned char) a[an - 1], y = (unsigned char) b[0];
+        if (isIdChar(x) && isIdChar(y))
+            return true;
+        switch (at) {
+            case Token::IDENTIFIER:
+                // an encoding prefix
+                return y == '"' || y == '\'';
+            case Token::NUMBER:
+                return y == '.' || y == '\'' || ((y == '+' || y == '-') && strchr("eEpP", x));
+            case Token::CHARACTER:
+            case Token::STRING:
+                // a literal suffix
+                return isIdChar(y);
+            default:
+                break;
+        }
+        if ((x == '/' && (y == '/' || y == '*')) || (x == '.' && (y == '.' || isdigit(y))))
+            return true;
+        if (an > 3 || !ispunct(y))
+            return false;
+        char joined[6];
+        auto n = std::min(bn, 6 - an);
+        memcpy(joined, a, an);
+        memcpy(joined + an, b, n);
+        return matchPunc(joined, an + n) > an;
+    }
+}
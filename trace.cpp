@@ -0,0 +1,127 @@
+#include "preprocessor.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace cpp {
+    namespace {
+        void writeString(std::ostream &os, const std::string &s) {
+            os << '"';
+            for (auto c: s) {
+                if (c == '"' || c == '\\') {
+                    os << '\\' << c;
+                } else if ((unsigned char) c < 0x20) {
+                    char buffer[8];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    os << buffer;
+                } else {
+                    os << c;
+                }
+            }
+            os << '"';
+        }
+    }
+
+    IncludeTracer::IncludeTracer():
+            origin(std::chrono::steady_clock::now()), stack(), events(), totals() {}
+
+    double IncludeTracer::now() const {
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - origin;
+        return elapsed.count();
+    }
+
+    void IncludeTracer::push(const std::string &file, bool include) {
+        stack.push_back(Event());
+        auto &event = stack.back();
+        event.file = file;
+        event.include = include;
+        event.start = now();
+        event.duration = 0;
+        event.nested = 0;
+    }
+
+    void IncludeTracer::pop() {
+        auto event = std::move(stack.back());
+        stack.pop_back();
+        event.duration = now() - event.start;
+        if (!stack.empty())
+            stack.back().nested += event.duration;
+        if (event.include) {
+            auto &total = totals[event.file];
+            total.count++;
+            total.time += event.duration - event.nested;
+            total.counts.bytes += event.counts.bytes;
+            total.counts.tokens += event.counts.tokens;
+            total.counts.macros += event.counts.macros;
+            total.counts.expansions += event.counts.expansions;
+        }
+        events.push_back(std::move(event));
+    }
+
+    void IncludeTracer::beginFile(const std::string &file) {
+        push(file, false);
+    }
+
+    void IncludeTracer::endFile() {
+        // an error leaves includes open
+        while (!stack.empty())
+            pop();
+    }
+
+    void IncludeTracer::includeEnter(const std::string &file, const PosInfo &/* from */) {
+        push(file, true);
+    }
+
+    void IncludeTracer::includeLexed(const std::string &/* file */, unsigned long bytes, unsigned long tokens) {
+        if (!stack.empty()) {
+            stack.back().counts.bytes += bytes;
+            stack.back().counts.tokens += tokens;
+        }
+    }
+
+    void IncludeTracer::includeExit(const std::string &/* file */) {
+        if (!stack.empty() && stack.back().include)
+            pop();
+    }
+
+    void IncludeTracer::macroDefined(const Macro &/* macro */, const PosInfo &/* pos */) {
+        if (!stack.empty())
+            stack.back().counts.macros++;
+    }
+
+    void IncludeTracer::macroExpanded(const Macro &/* macro */, const PosInfo &/* pos */) {
+        if (!stack.empty())
+            stack.back().counts.expansions++;
+    }
+
+    void IncludeTracer::writeTrace(std::ostream &os) const {
+        os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        for (unsigned long i = 0; i<events.size(); i++) {
+            const auto &event = events[i];
+            os << (i? ",\n": "\n") << "{\"name\": ";
+            writeString(os, event.file);
+            os << ", \"cat\": \"" << (event.include? "include": "file") << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1"
+               << ", \"ts\": " << (unsigned long) event.start << ", \"dur\": " << (unsigned long) event.duration
+               << ", \"args\": {\"bytes\": " << event.counts.bytes << ", \"tokens\": " << event.counts.tokens
+               << ", \"macros\": " << event.counts.macros << ", \"expansions\": " << event.counts.expansions << "}}";
+        }
+        os << "\n]}\n";
+    }
+
+    void IncludeTracer::writeSummary(std::ostream &os) const {
+        std::vector<std::pair<std::string, Total>> sorted(totals.begin(), totals.end());
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const std::pair<std::string, Total> &a, const std::pair<std::string, Total> &b) {
+                             return a.second.time > b.second.time;
+                         });
+        char line[128];
+        snprintf(line, sizeof(line), "%10s %6s %10s %10s %8s %10s  %s\n",
+                 "self ms", "count", "bytes", "tokens", "macros", "expansions", "header");
+        os << line;
+        for (const auto &entry: sorted) {
+            const auto &total = entry.second;
+            snprintf(line, sizeof(line), "%10.3f %6lu %10lu %10lu %8lu %10lu  ", total.time / 1000, total.count,
+                     total.counts.bytes, total.counts.tokens, total.counts.macros, total.counts.expansions);
+            os << line << entry.first << '\n';
+        }
+    }
+}